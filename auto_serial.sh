@@ -10,7 +10,9 @@
 DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)
 cd $DIR
 
-baudRate=${1-115200}
+# Baud rate: first argument, else BAUD (as given to make), else the firmware default
+# (note that socat/termios has no 250000 rate, use 500000 or 1000000 for the high rates)
+baudRate=${1-${BAUD-115200}}
 resumeNow=
 socatPid=
 
@@ -12,20 +12,12 @@
 #include "serial.h"
 #include "steppers.h"
 #include "external.h"
+#include "homing.h"
+#include "status.h"
+#include "telemetry.h"
+#include "protocol.h"
 #include <avr/eeprom.h>
 
-#define SEEK_COARSE_SPEED_RATIO		0.3		// how fast to seek (first pass)
-#define SEEK_COARSE_LENGTH_MM		400.0	// bed may start completely at the bottom
-
-#define SEEK_FINE_SPEED_RATIO		0.1		// how fast to seek (second pass)
-#define SEEK_LENGTH_MM				1.5		// length to look up again after initial hit and retract
-
-#define SEEK_DOWN_RATIO				1		// how fast to retract (limits are ignored anyway)
-
-#define SEEK_DOWN_SETTLE_HOME_MS	200		// time to wait in low state before homing (make sure the end stops are off)
-#define SEEK_DOWN_SETTLE_LONG_MS	400		// initial time to wait before seeking up first time
-#define SEEK_DOWN_SETTLE_SHORT_MS	150		// time to wait before seeking up again slowly
-
 // Temporary modes: make sure to check your scope for these automatic status/instances!
 #define TEMP_RELATIVE_MODE			Backup<bool> _trm(steppers_relative_mode, true)
 #define TEMP_ABSOLUTE_MODE			Backup<bool> _tam(steppers_relative_mode, false)
@@ -33,14 +25,69 @@
 #define TEMP_IGNORE_LIMITS 			Backup<volatile bool> _til(steppers_respect_endstop,false);
 
 #define EEPROM_AXES_OFFSETS_ADDR	64
-
-static char cmd_buf[32];
-static uint8_t cmd_len= 0;
+#define EEPROM_VERBOSITY_ADDR		80
+
+#define RUN_ERROR					0
+#define RUN_OK						1
+#define RUN_PENDING					2	// acknowledged later, by the sequence
+
+#define VERBOSITY_QUIET				0	// replies are $ or ? alone
+#define VERBOSITY_NORMAL			1	// replies repeat the command
+#define VERBOSITY_ECHO				2	// the received bytes and the command run are echoed as well (default)
+
+// Command lines are parsed in place in the RX buffer, only a line which wraps around its end is copied
+static char cmd_buf[RX_BUFFER_SIZE];
+static char pending_cmd[COMMAND_KEPT_LENGTH];		// command received while a sequence is running
+static const char* cmd_line= cmd_buf;
+static uint8_t cmd_len= 0;			// length of cmd_line when it is in the RX buffer (released after the run)
+static bool cmd_in_rx= false;
+static bool cmd_overflow= false;	// the RX buffer was flushed in the middle of a line: drop its end
 static float speed_factor= 1.0;
 
+// Streaming mode: no echo, no timeout, and the replies carry the command sequence id and the free RX space
+static bool streaming= false;
+static uint8_t next_seq= 0;
+static uint8_t seq_reserved= 0;	// bit i: id next_seq+i was given to an immediate command run ahead of its turn
+static uint8_t pending_seq;
+uint8_t command_seq= 0;		// sequence id of the command being replied to
+
 float axis_offsets[3];
+static uint8_t verbosity= VERBOSITY_ECHO;
+
+// Sequence id of the next command (in arrival order)
+static uint8_t take_seq()
+{
+	while(seq_reserved & 1)
+	{
+		seq_reserved>>= 1;
+		++next_seq;
+	}
+	seq_reserved>>= 1;
+	return next_seq++;
+}
+
+// Reserves the sequence id of the command which comes after n others, false if too far ahead
+static bool reserve_seq(uint8_t n, uint8_t* seq)
+{
+	for(uint8_t i=0; i<8; ++i)
+	{
+		if(seq_reserved & (1<<i))
+			continue;
+		if(!n--)
+		{
+			seq_reserved|= 1<<i;
+			*seq= next_seq + i;
+			return true;
+		}
+	}
+	return false;
+}
 
 void cmd_show_status();
+static void command_execute_frame();
+static void command_release_line();
+static bool is_immediate(char cmd0);
+static void execute(const char* cmd);
 
 void load_axes_offsets()
 {
@@ -58,12 +105,32 @@ void save_axes_offsets()
 	eeprom_write_float(a++, axis_offsets[2]);
 }
 
-bool error(const char* cmd)
+void load_verbosity()
 {
-	print_char('?');
-	print_string(cmd);
+	verbosity= eeprom_read_byte((const uint8_t *)EEPROM_VERBOSITY_ADDR);
+	if(verbosity>VERBOSITY_ECHO) // blank EEPROM
+		verbosity= VERBOSITY_ECHO;
+}
+
+// Reply to a command: $ or ?, then the command (unless quiet), or "#<seq>,<free RX bytes>" in streaming mode
+static void reply(char status, const char* cmd)
+{
+	print_char(status);
+	if(streaming)
+	{
+		print_char('#');
+		print_uint8_base10(command_seq);
+		print_char(',');
+		print_uint8_base10(RX_BUFFER_SIZE - serial_get_rx_buffer_count() + (cmd_in_rx ? cmd_len+1 : 0)); // the running line is about to be released
+	}
+	else if(verbosity>VERBOSITY_QUIET)
+		print_string(cmd);
 	print_char('\n');
-	delay_ms(10);
+}
+
+bool error(const char* cmd)
+{
+	reply('?', cmd);
 	return false;
 }
 
@@ -72,7 +139,6 @@ void info(const char* cmd)
 	print_char(';');
 	print_string(cmd);
 	print_char('\n');
-	delay_ms(10);
 }
 
 void info(const char* cmd, float v)
@@ -81,7 +147,19 @@ void info(const char* cmd, float v)
 	print_string(cmd);
 	print_float(v);
 	print_char('\n');
-	delay_ms(10);
+}
+
+// End of a queued move: ";<event>", followed by "#<seq>" of the command which queued it in streaming mode
+static void info_motion(const char* event, uint8_t seq)
+{
+	print_char(';');
+	print_string(event);
+	if(streaming)
+	{
+		print_char('#');
+		print_uint8_base10(seq);
+	}
+	print_char('\n');
 }
 
 void info_axis(int axis)
@@ -94,16 +172,17 @@ void info_axis(int axis)
 	print_char(sticky_limit_is_hit(axis)?'1':'0');
 	print_string(",o");
 	print_float(axis_offsets[axis]);
+	if(limit_is_latched(axis))
+	{
+		print_string(",T");
+		print_float(limit_get_latched_position(axis));
+	}
 	print_char('\n');
-	delay_ms(10);
 }
 
 bool success(const char* cmd)
 {
-	print_char('$');
-	print_string(cmd);
-	print_char('\n');
-	delay_ms(10);
+	reply('$', cmd);
 	return true;
 }
 
@@ -123,76 +202,6 @@ bool force_movement(char axis_letter=0)
 	return true;
 }
 
-/**
- * Move bed down until sensors are no more activated.
- * The usual context is to call this *immediately* after homing up and before setting home with z
- */
-bool down_detach()
-{
-	TEMP_RELATIVE_MODE;
-	TEMP_IGNORE_LIMITS; // else no movement may be done ("sticky_limits"
-	for(uint8_t pass=0;pass<3;++pass)
-	{
-		sticky_limits= 0; delay_ms(100); // this is to catch any bouncing limits
-		if(limits_get_rt_states() || sticky_limits)
-		{
-			stepper_set_targets(5, 0.01); // very slow asynchronous call: just to detach the bed from the tool head
-			while(limits_get_rt_states() && steppers_are_moving() && !nmi_reset);
-	steppers_settle_here(); // stop all movement asap
-		}
-	}
-
-	sticky_limits= limits_get_rt_states();
-	return(!sticky_limits);
-}
-
-bool down_detach_single(uint8_t axis)
-{
-	// TODO: change movement to be short sequences of [down/up/down] to avoid sensor saturation
-	TEMP_IGNORE_LIMITS; // else no movement will be done
-	TEMP_RELATIVE_MODE;
-	while( (limits_get_rt_states() & (1<<axis)) )
-	{
-		// clear the limit
-	sticky_limits &= ~(1<<axis);
-
-		stepper_set_target(axis, 1, 0.01); // asynchronous call: down slowly, just to detach the bed from the tool head
-	while((limits_get_rt_states()&(1<<axis)) && stepper_is_moving(axis) && !nmi_reset);
-	stepper_settle_here(axis); // stop all movement asap
-		delay_ms(100);
-	}
-
-	bool r=!(limits_get_rt_states() & (1<<axis));
-	return r;
-}
-
-// Detect all bed upwards and retract a little to detach from the sensor
-bool detect_up(float speed, float length_upwards)
-{
-	TEMP_RELATIVE_MODE;
-	// Up by 20 (expecting to hit the limits, head is in the center of the bed, bed is approximately flat -- as always!)
-	sticky_limits= 0;
-	move_modal(-length_upwards, speed); // slow upwards (we're expecting to trigger one or many end stops)
-	steppers_settle_here();
-	bool ret= (sticky_limits!=0); // positive when sticky_limits is enabled
-	down_detach();
-	return ret;
-}
-
-// Detect bed upwards and retract a little to detach from the sensor
-bool detect_up_axis(uint8_t axis, float speed, float length_upwards)
-{
-	TEMP_RELATIVE_MODE;
-	TEMP_USE_LIMITS;
-	// Up by 20 (expecting to hit the limits, head is in the center of the bed, bed is approximately flat -- as always!)
-	sticky_limits= 0;
-	move_modal_axis(axis, -length_upwards, speed); // slow upwards. We're expecting to trigger at least one end stop
-	stepper_settle_here(axis);
-	bool ret= ((sticky_limits&(1<<axis))!=0); // we want this axis to hit the limit
-	down_detach_single(axis);
-	return ret;
-}
-
 // ======================= All 3 axis =======================
 
 void cmd_show_status()
@@ -223,171 +232,222 @@ void cmd_show_status()
 	print_unsigned_int8(rl,2,3);
 	print_pstr("\n");
 
-	for(uint8_t axis=0; axis<3; ++axis)
-		info_axis(axis);
-
-	// print_pstr(";ram="); print_integer(get_free_memory()); print_char('\n');
-
-}
-
-/**
- * 3-way simultaneous homing and origin ("standard homing", may occur after calibration)
- */
-bool cmd_home_origin(bool slow_but_safe)
-{
-	TEMP_RELATIVE_MODE;
-	limits_enable();
+	print_pstr(";ext=");
+	print_integer(external_get_queue_overflows());
+	print_char(',');
+	print_integer(external_get_late_steps());
+	print_char(',');
+	print_integer(external_get_rejected_edges());
+	print_char(',');
+	print_integer(external_get_suspicious_edges());
+	print_pstr("\n");
 
-	if(slow_but_safe)
-	{
-		TEMP_IGNORE_LIMITS;
-		move_modal(SEEK_LENGTH_MM, SEEK_COARSE_SPEED_RATIO);
-		delay_ms(SEEK_DOWN_SETTLE_HOME_MS); // dynamic FSR sensors stabilization (idle)
-	}
+	if(streaming)
+		info("stream");
+	print_pstr(";v=");
+	print_integer(verbosity);
+	print_pstr("\n");
 
-	// Long, coarse upwards seek (first home seek)
-	info("h/coarse");
-	if(!detect_up(SEEK_COARSE_SPEED_RATIO, SEEK_COARSE_LENGTH_MM)) goto failToDetectUpwards;
+	print_pstr(";ovr=");
+	print_integer(steppers_get_override());
+	if(steppers_is_held())
+		print_char('h');
+	print_pstr("\n");
 
-	// Down by a little bit again to redo a finer seek
-	{
-		TEMP_IGNORE_LIMITS;
-		move_modal(SEEK_LENGTH_MM, SEEK_DOWN_RATIO);
-		delay_ms(SEEK_DOWN_SETTLE_SHORT_MS);
-	}
+	print_pstr(";tlm=");
+	print_integer(telemetry_get_period());
+	if(telemetry_is_on_change())
+		print_char('c');
+	print_pstr("\n");
 
-	// Seek for limit switch upwards again, but slower (fine seek)
-	{
-		info("h/fine");
-		if(!detect_up(SEEK_FINE_SPEED_RATIO, SEEK_LENGTH_MM+0.5)) goto failToDetectUpwards;
-	}
+	// Hard stops: count, worst latency (us) and worst steps after the trigger edge
+	print_pstr(";stop=");
+	print_integer(limit_stops.events);
+	print_char(',');
+	print_integer(limit_stops.max_latency_us);
+	print_char(',');
+	print_integer(limit_stops.max_steps);
+	print_pstr("\n");
 
-	// Finalize
-	info("h/origin");
+	for(uint8_t axis=0; axis<3; ++axis)
+		info_axis(axis);
 
-	// Contrary to calibration, we are NOT applying any offsets after homing!
-	// Why? The external master may rely directly on the end stop signals,
-	// so he will have to deal with overall bed offset himself!
+	sequence_report();
 
-	set_origin();
-	delay_ms(10);
-	sticky_limits= 0;
-	return true;
+	// print_pstr(";ram="); print_integer(get_free_memory()); print_char('\n');
 
-failToDetectUpwards:
-	nmi_reset= true; // hard failure: homing is vital
-	return false;
 }
 
-// ======================= One axis only =======================
 
-
-bool cmd_calibrate_axis(uint8_t axis, bool slow_but_safe)
+// Serial link health: ;link=rx dropped,rx overruns,rx framing errors,rx high-water/size,tx high-water/size
+static void cmd_show_link(bool clear)
 {
-	TEMP_RELATIVE_MODE;
-	limits_enable();
-
-	if(axis==0) // axis zero is the reference in any case, so calibration is
-		return cmd_home_origin(slow_but_safe); // equivalent to homing + set origin
+	serial_stats s;
+	serial_get_stats(&s);
+	if(clear)
+		serial_reset_stats();
+	print_pstr(";link=");
+	print_integer(s.rx_dropped);
+	print_char(',');
+	print_integer(s.rx_overruns);
+	print_char(',');
+	print_integer(s.rx_frame_errors);
+	print_char(',');
+	print_integer(s.rx_high_water);
+	print_char('/');
+	print_integer(RX_BUFFER_SIZE);
+	print_char(',');
+	print_integer(s.tx_high_water);
+	print_char('/');
+	print_integer(TX_BUFFER_SIZE);
+	print_pstr("\n");
+}
 
-	if(slow_but_safe)
-	{
-		TEMP_IGNORE_LIMITS;
-		move_modal(SEEK_LENGTH_MM, SEEK_DOWN_RATIO);
-		delay_ms(SEEK_DOWN_SETTLE_LONG_MS); // stabilize dynamic sensors
-	}
+// ======================= Command interpreter =======================
 
-	// Grouped coarse upwards (aka homing without setting origins)
+unsigned long command_start_time= 0;
+#define COMMAND_COLLECT_TIMEOUT_MS 100
+// Streaming and a command waits for the running one: the next ordinary commands are kept in the RX buffer (the
+// host sees it is not free), but the immediate ones and the binary frames are taken out and run right away.
+// An immediate command gets the sequence id of its place in the stream.
+static void command_collect_immediate()
+{
+	uint8_t count= serial_get_rx_buffer_count();
+	uint8_t offset= 0;
+	uint8_t ahead= 0; // text commands kept before this line
+	while(offset<count)
 	{
-		info("cn/common");
-		if(!detect_up(SEEK_COARSE_SPEED_RATIO, SEEK_COARSE_LENGTH_MM)) goto failure;
-	}
-
+		if(serial_rx_peek(offset)==PROTOCOL_SYNC) // binary frame (see protocol.h)
+		{
+			if(offset+1>=count)
+				return;
+			uint8_t length= serial_rx_peek(offset+1);
+			if(length<2 || length>PROTOCOL_MAX_LENGTH || offset+length+3>count)
+				return; // bad or incomplete: left to command_collect()
+			if(offset)
+			{
+				uint8_t frame[PROTOCOL_MAX_LENGTH+3];
+				serial_rx_take(offset, frame, length+3);
+				bool ok= false;
+				for(uint8_t i=0; i<length+3; ++i)
+					ok= protocol_collect(frame[i]);
+				if(ok)
+					command_execute_frame();
+				return; // the bytes after it moved: scan again on the next call
+			}
+			offset+= length+3;
+			continue;
+		}
 
-	// Lower the individual axis slightly
-	{
-		TEMP_IGNORE_LIMITS;
-		move_modal_axis(axis, SEEK_LENGTH_MM, SEEK_DOWN_RATIO);
-		delay_ms(slow_but_safe ? SEEK_DOWN_SETTLE_LONG_MS : SEEK_DOWN_SETTLE_SHORT_MS); // add enough time for the sensors to forget the last pressure level
+		uint8_t len= serial_rx_find_line_end(offset);
+		if(len==0xFF)
+			return;
+		if(len)
+		{
+			bool weird= false;
+			for(uint8_t i=0; i<len; ++i)
+				if(serial_rx_peek(offset+i)<' ')
+					weird= true;
+			uint8_t seq;
+			if(!weird && is_immediate(serial_rx_peek(offset)) && reserve_seq(ahead, &seq))
+			{
+				serial_rx_take(offset, (uint8_t *)cmd_buf, len+1);
+				cmd_buf[len]= 0;
+				command_seq= seq;
+				execute(cmd_buf);
+				return; // the bytes after it moved: scan again on the next call
+			}
+			++ahead;
+		}
+		offset+= len+1;
 	}
+}
 
-	// Fine seek end stop upwards for this axis
+bool command_collect()
+{
+	// Binary frame (not echoed), fed byte per byte: it may carry zero bytes and line ends
+	uint8_t count= serial_get_rx_buffer_count();
+	if(protocol_is_collecting() || (count && serial_rx_peek()==PROTOCOL_SYNC))
 	{
-		info("cn/fine");
-		if(!detect_up_axis(axis, SEEK_FINE_SPEED_RATIO, SEEK_LENGTH_MM+0.5)) // only 0.5 mm overshoot
-			goto failure;
+		if(!count)
+		{
+			if(protocol_timeout())
+				error("timeout");
+		}
+		else if(protocol_collect(serial_read()))
+			command_execute_frame();
+		return false;
 	}
-	// Eventually, apply axis-specific retraction (stored in EEPROM)
-	move_modal_axis(axis, axis_offsets[axis], 1);
 
-	// Numerically, we say we are back at the same height as the reference axis, i.e. zero since we homed in the first place
+	if(streaming && pending_cmd[0])
 	{
-		info("cn/offset");
-		stepper_zero(axis);
+		command_collect_immediate();
+		return false;
 	}
 
-	// success
-	return true;
-
-failure:
-	nmi_reset= true; // hard failure: calibration is vital
-	return false;
-}
-
-
-// ======================= Command interpreter =======================
-
-unsigned long command_start_time= 0;
-#define COMMAND_COLLECT_TIMEOUT_MS 100
-bool command_collect()
-{
-	uint8_t c= serial_read();
-	if(c==SERIAL_NO_DATA)
+	// Text: wait for the RX interrupt to mark a complete line
+	if(!serial_rx_line_count())
 	{
-		if(command_start_time) // a command is being collected
+		if(serial_rx_is_stuck()) // no room left for the line end
+		{
+			serial_reset_read_buffer();
+			command_start_time= 0;
+			cmd_overflow= true;
+			command_seq= take_seq();
+			error("too long");
+		}
+		else if(!count)
+			command_start_time= 0;
+		else if(!streaming) // a command is being collected (pipelined bytes are never flushed when streaming)
 		{
 			uint64_t t= millis();
-			if(t > command_start_time+COMMAND_COLLECT_TIMEOUT_MS)
+			if(!command_start_time)
+				command_start_time= t;
+			else if(t > command_start_time+COMMAND_COLLECT_TIMEOUT_MS)
 			{
 				serial_reset_read_buffer(); // Clear serial read buffer
 				command_start_time= 0;
-				cmd_len= 0;
-				cmd_buf[0]= 0;
 				error("timeout");
-				return false;
 			}
-
 		}
+		return false;
+	}
+	command_start_time= 0;
 
+	uint8_t len= serial_rx_line_length();
+	uint8_t end= serial_rx_peek(len);
+	char* line= serial_rx_line_in_place(len);
+	cmd_in_rx= line!=NULL;
+	if(!line) // wraps around the RX buffer end
+	{
+		serial_rx_copy_line(cmd_buf, len);
+		serial_rx_consume_line(len);
+		line= cmd_buf;
 	}
-	else // we have serial data
+	cmd_line= line;
+	cmd_len= len;
+
+	if(!streaming && verbosity>=VERBOSITY_ECHO)
 	{
-		if(!command_start_time)
-			command_start_time= millis();
-		serial_write(c);
-		if(c=='\r'||c=='\n')
-		{
-			if(cmd_len==0xFF)
-				error("discarded");
-			else
-			{
-				cmd_buf[cmd_len]= 0;
-				cmd_len= 0;
-				command_start_time= 0;
-				return true; // we have collected a complete command
-			}
-			cmd_len= 0;
-		}
-		else if(c<' ')
-			cmd_len= 0xFF; // ignore command when a weird character is received
-		else if(cmd_len>=sizeof(cmd_buf)-1)
-		{
-			error("too long\n");
-			cmd_len= 0;
-		}
-		else
-			cmd_buf[cmd_len++]= c;
+		serial_write_block((const uint8_t *)line, len);
+		serial_write(end);
+	}
+
+	bool weird= false; // ignore command when a weird character is received
+	for(uint8_t i=0; i<len; ++i)
+		if((uint8_t)line[i]<' ')
+			weird= true;
+
+	if(cmd_overflow)
+		cmd_overflow= false; // end of a line too long, already reported
+	else if(weird)
+	{
+		command_seq= take_seq();
+		error("discarded");
 	}
+	else if(len)
+		return true; // we have collected a complete command, run it from there
+	command_release_line();
 	return false;
 }
 
@@ -414,6 +474,20 @@ const char* string_to_float(const char* p, float* v)
 	return p;
 }
 
+// Parses "<mm>" or "<0-2> <mm>" (axis is MOTION_ALL_AXES for the former)
+bool parse_move(const char* p, uint8_t* axis, float* pos)
+{
+	*axis= MOTION_ALL_AXES;
+	if(*p>='0' && *p<='2' && *(p+1)==' ') // syntax variant g<axis> <mm>
+	{
+		*axis= (*p-'0');
+		++p;
+		while(*p && *p==' ') ++p;
+	}
+	p= string_to_float(p, pos);
+	return !*p;
+}
+
 bool enabled()
 {
 	if(!stepper_are_powered())
@@ -424,15 +498,30 @@ bool enabled()
 	return true;
 }
 
-bool run(const char* cmd/*= NULL*/)
+// The command started a sequence: it is acknowledged when the sequence ends
+static uint8_t start_sequence(uint8_t sequence, uint8_t axis, bool slow_but_safe, const char* cmd)
+{
+	if(!sequence_start(sequence, axis, slow_but_safe, cmd))
+		return RUN_ERROR;
+	return RUN_PENDING;
+}
+
+uint8_t run(const char* cmd/*= NULL*/)
 {
 	char cmd0= cmd[0];
 	char cmd1= cmd[1];
 
 	if(cmd0=='?')
 	{
-		print_pstr_slow(";help:\n\
+		print_pstr(";help:\n\
 ;! - status\n\
+;!s - compact status line\n\
+;!b - binary status frame\n\
+;!l|!L - serial link health (L: then clear)\n\
+;t<ms>|tc|t0 - telemetry period/on change/off\n\
+;w<0|1> - streaming mode (replies: $#seq,rx_free)\n\
+;v<0-2> - verbosity: quiet/normal/echo (saved)\n\
+;0x81..0x86 - real-time: hold/resume/speed +10%/-10%/100%/telemetry frame\n\
 ;=<C|E> - config vs. external mode\n\
 ;s<0-2> - settle here\n\
 ;p<0|1> - power\n\
@@ -441,20 +530,38 @@ bool run(const char* cmd/*= NULL*/)
 ;x<0-2> - clear limits\n\
 ;l<0|1> - respect limits\n\
 ;h - main home\n\
+;H - main home (quick)\n\
+;hf - main home (fast single pass)\n\
 ;z<0-2> - zero origin\n\
 ;c<0-2> - calibrate\n\
+;c - calibrate all axes at once\n\
+;d<0-2> - detach\n\
+;k - cancel homing/calibration/queued moves\n\
+;b<n> - homing repeatability benchmark\n\
+;bf<n> - single pass homing repeatability benchmark\n\
+;b<n> <mm> - moves benchmark\n\
 ;o<0-2,mm> - record axis offset\n\
 ;g<0-2> <mm> - move one axis\n\
-;g<mm> - move bed\n");
-		return true;
+;g<mm> - move bed\n\
+;G<0-2> <mm>, G<mm> - queued move (;done[#seq] when reached, or ;limit_hit[#seq] and ;cancelled:<n>)\n");
+		return RUN_OK;
 	}
 
 	// ----------------------------------------------------------------------------------------
-	if(cmd0=='!') // ! - show status
+	if(cmd0=='!') // ! - show status, !s - compact status line, !b - binary status frame, !l|!L - serial link health (L: then clear)
 	{
-		if(cmd1) return false;
-		cmd_show_status();
-		return true;
+		if(cmd1 && cmd[2]) return RUN_ERROR;
+		if(cmd1=='s')
+			status_print_line();
+		else if(cmd1=='b')
+			status_send_frame();
+		else if(cmd1=='l' || cmd1=='L')
+			cmd_show_link(cmd1=='L');
+		else if(!cmd1)
+			cmd_show_status();
+		else
+			return RUN_ERROR;
+		return RUN_OK;
 	}
 
 	if(cmd0=='s') // s -settle here (stop movement, and cancels the ones which were paused due to the end stops)
@@ -462,12 +569,12 @@ bool run(const char* cmd/*= NULL*/)
 		if(!cmd1)
 		{
 			steppers_settle_here();
-			return true;
+			return RUN_OK;
 		}
 		uint8_t axis= (cmd1-'0');
 		if(axis>2) goto badAxis;
 		stepper_settle_here(axis);
-		return true;
+		return RUN_OK;
 	}
 
 	// ---------------------------------------------------------------------------------------- config
@@ -477,43 +584,43 @@ bool run(const char* cmd/*= NULL*/)
 	{
 		if(cmd1 && !cmd[2])
 		{
-			if(cmd1=='0')	{ stepper_power(false); return true; }
-			if(cmd1=='1')	{ stepper_power(true); return true; }
+			if(cmd1=='0')	{ stepper_power(false); return RUN_OK; }
+			if(cmd1=='1')	{ stepper_power(true); return RUN_OK; }
 		}
 		goto badAxis;
 	}
 
 	if(cmd0=='r') // r<ratio> - speed ratio
 	{
-		if(!cmd1) return false;
+		if(!cmd1) return RUN_ERROR;
 		float pos;
 		const char* p= string_to_float(cmd+1, &pos);
 		if(*p)
 		{
 			info("ratio?");
-			return false;
+			return RUN_ERROR;
 		}
 		speed_factor= pos;
-		return true;
+		return RUN_OK;
 	}
 
 	if(cmd0=='m') // m<R|A> - relative or absolute mode
 	{
 		if(cmd1 && !cmd[2])
 		{
-			if(cmd1=='R')	{ steppers_relative_mode= true; return true; }
-			if(cmd1=='A')	{ steppers_relative_mode= false; return true; }
+			if(cmd1=='R')	{ steppers_relative_mode= true; return RUN_OK; }
+			if(cmd1=='A')	{ steppers_relative_mode= false; return RUN_OK; }
 		}
 		info("R|A?");
-		return false;
+		return RUN_ERROR;
 	}
 
 	if(cmd0=='l') // l<0|1> - enable/disable limits interruptions (and clear sticky bit)
 	{
 		if(cmd1 && !cmd[2])
 		{
-			if(cmd1=='0')	{ limits_disable(); return true; }
-			if(cmd1=='1')	{ limits_enable(); return true; }
+			if(cmd1=='0')	{ limits_disable(); return RUN_OK; }
+			if(cmd1=='1')	{ limits_enable(); return RUN_OK; }
 		}
 		goto badAxis;
 	}
@@ -521,51 +628,122 @@ bool run(const char* cmd/*= NULL*/)
 
 	// ---------------------------------------------------------------------------------------- movement: setup
 
-	if(cmd0=='h') // h - homing (safe mode)
+	if(cmd0=='h') // h - homing (safe mode), hf - single pass homing
 	{
-		if(cmd1) return false;
+		if(cmd1=='f' && !cmd[2])
+		{
+			stepper_power(true);
+			return start_sequence(SEQ_HOME_FAST, 0, false, cmd);
+		}
+		if(cmd1) return RUN_ERROR;
 		stepper_power(true); // one way to boot up the steppers
-		return cmd_home_origin(true);
+		return start_sequence(SEQ_HOME, 0, true, cmd);
 	}
 
-	if(cmd0=='h') // H - homing (quick mode)
+	if(cmd0=='H') // H - homing (quick mode)
 	{
-		if(cmd1) return false;
+		if(cmd1) return RUN_ERROR;
 		stepper_power(true);
-		return cmd_home_origin(false);
+		return start_sequence(SEQ_HOME, 0, false, cmd);
 	}
 
 	if(cmd0=='d') // d or d<0-2> - detach or detach axis
 	{
 		stepper_power(true);
 		if(!cmd1)
-			return down_detach();
+			return start_sequence(SEQ_DETACH, 0, false, cmd);
 		uint8_t axis= (cmd1-'0');
 		if(axis>2) goto badAxis;
-		return down_detach_single(axis);
+		return start_sequence(SEQ_DETACH_AXIS, axis, false, cmd);
 	}
 
-	if(cmd0=='c') // c<0-2> - calibrate (safe mode)
+	if(cmd0=='c' || cmd0=='C') // c<0-2> - calibrate (safe mode), C<0-2> - calibrate (quick mode), c or C - calibrate all axes
 	{
+		bool slow_but_safe= (cmd0=='c');
+		if(!cmd1)
+		{
+			stepper_power(true);
+			return start_sequence(SEQ_CALIBRATE_ALL, 0, slow_but_safe, cmd);
+		}
 		uint8_t axis= (cmd1-'0');
 		if(axis>2) goto badAxis;
 		stepper_power(true);
-		return cmd_calibrate_axis(axis, true);
+		// axis zero is the reference in any case, so calibration is equivalent to homing + set origin
+		return start_sequence(axis==0 ? SEQ_HOME : SEQ_CALIBRATE_AXIS, axis, slow_but_safe, cmd);
 	}
 
-	if(cmd0=='C') // C<0-2> - calibrate (quick mode)
+	if(cmd0=='w') // w<0|1> - streaming mode off/on
 	{
-		uint8_t axis= (cmd1-'0');
-		if(axis>2) goto badAxis;
-		stepper_power(true);
-		return cmd_calibrate_axis(axis, false);
+		if(cmd1 && !cmd[2])
+		{
+			if(cmd1=='0')	{ streaming= false; return RUN_OK; }
+			if(cmd1=='1')	{ streaming= true; command_start_time= 0; return RUN_OK; }
+		}
+		goto badAxis;
+	}
+
+	if(cmd0=='v') // v<0-2> - verbosity, saved in the EEPROM
+	{
+		if(cmd1>='0' && cmd1-'0'<=VERBOSITY_ECHO && !cmd[2])
+		{
+			verbosity= cmd1-'0';
+			eeprom_update_byte((uint8_t *)EEPROM_VERBOSITY_ADDR, verbosity);
+			return RUN_OK;
+		}
+		goto badAxis;
+	}
+
+	if(cmd0=='t') // t<ms> - telemetry every <ms>, tc - telemetry on change, t0 - telemetry off
+	{
+		if(cmd1=='c' && !cmd[2])
+		{
+			telemetry_set(0, true);
+			return RUN_OK;
+		}
+		float period;
+		const char* p= string_to_float(cmd+1, &period);
+		if(!cmd1 || *p || period<0 || period>60000)
+		{
+			info("ms?");
+			return RUN_ERROR;
+		}
+		telemetry_set((uint16_t)period, false);
+		return RUN_OK;
+	}
+
+	if(cmd0=='b') // b<cycles> - homing repeatability benchmark, bf<cycles> - same with single pass homing, b<cycles> <mm> - back and forth moves benchmark
+	{
+		if(!enabled()) return RUN_ERROR;
+		bool single_pass= (cmd1=='f');
+		float cycles, mm= 0;
+		const char* p= string_to_float(cmd+(single_pass ? 2 : 1), &cycles);
+		while(*p==' ') ++p;
+		if(*p && !single_pass)
+			p= string_to_float(p, &mm);
+		if(*p || cycles<1 || cycles>255)
+		{
+			info("cycles?");
+			return RUN_ERROR;
+		}
+		uint8_t sequence= single_pass ? SEQ_BENCH_HOME_FAST : (mm==0 ? SEQ_BENCH_HOME : SEQ_BENCH_MOVE);
+		return sequence_start_benchmark(sequence, (uint8_t)cycles, mm, speed_factor, cmd) ? RUN_PENDING : RUN_ERROR;
+	}
+
+	if(cmd0=='k') // k - cancel the running homing/calibration/detach sequence, or the queued moves
+	{
+		if(cmd1) return RUN_ERROR;
+		if(motion_queue_cancel())
+			info("cancelled");
+		else if(!sequence_cancel())
+			info("idle");
+		return RUN_OK;
 	}
 
 	if(cmd0=='x') // x or x<0-2> - clear sticky limits and force/resume movement if any (very dangerous)
 	{
 		if(!force_movement(cmd1))
 			goto badAxis;
-		return true;
+		return RUN_OK;
 	}
 
 	// ---------------------------------------------------------------------------------------- movement: bed height
@@ -575,43 +753,43 @@ bool run(const char* cmd/*= NULL*/)
 		if(!cmd1)
 		{
 			set_origin();
-			return true;
+			return RUN_OK;
 		}
 		uint8_t axis= (cmd1-'0');
 		if(axis>2) goto badAxis;
 		set_origin_single(axis);
-		return true;
+		return RUN_OK;
 	}
 
-	if(cmd0=='g') // g<mm> or g<0-2> <mm>: move to a position
+	if(cmd0=='g' || cmd0=='G') // g<mm> or g<0-2> <mm>: move to a position, G: same but queued (asynchronous)
 	{
-		if(!enabled()) return false;
-		const char* p= cmd+1;
-		uint8_t axis=255;
-		if(*p>='0' && *p<='2' && *(p+1)==' ') // syntax variant g<axis> <mm>
+		if(!enabled()) return RUN_ERROR;
+		uint8_t axis;
+		float pos;
+		if(!parse_move(cmd+1, &axis, &pos)) goto badHeight;
+
+		if(cmd0=='G') // acknowledged now, ";done" or ";limit_hit" is sent when the move ends
 		{
-			axis= (*p-'0');
-			++p;
-			while(*p && *p==' ') ++p;
+			if(motion_queue_push(axis, pos, speed_factor, command_seq))
+				return RUN_OK;
+			info("full");
+			return RUN_ERROR;
 		}
-		float pos;
-		p= string_to_float(p, &pos);
-		if(*p) goto badHeight;
 
 		if(axis<3)
 		{
 			info("axis move!");
 			if(move_modal_axis(axis, pos, speed_factor))
-				return true;
+				return RUN_OK;
 		}
 		else
 		{
 			if(move_modal(pos, speed_factor))
-				return true;
+				return RUN_OK;
 		}
 		info("limit_hit");
 		steppers_zero_speed(); // restart at slow speed if resumed
-		return false;
+		return RUN_ERROR;
 	}
 
 	if(cmd0=='o') // o<0-2=mm> : set an individual axis gap
@@ -637,40 +815,201 @@ bool run(const char* cmd/*= NULL*/)
 
 		// Show this axis state
 		info_axis(axis);
-		return true;
+		return RUN_OK;
 	}
 
 	// ----------------------------------------------------------------------------------------
 
 	info("unknown");
-	return false;
+	return RUN_ERROR;
 
 badAxis:
 	info("0-N?");
-	return false;
+	return RUN_ERROR;
 
 badHeight:
 	info("height?");
-	return false;
+	return RUN_ERROR;
 }
 
 // ---------------------------------------------------------------------------------
 
+// Commands allowed while a sequence is running (the others are deferred)
+static bool is_immediate(char cmd0)
+{
+	return cmd0=='!' || cmd0=='?' || cmd0=='k' || cmd0=='t';
+}
+
+static void execute(const char* cmd)
+{
+	// Echo input command
+	if(!streaming && verbosity>=VERBOSITY_ECHO)
+	{
+		print_pstr(">");
+		print_string(cmd);
+		print_pstr("\n");
+	}
+
+	uint8_t r= run(cmd);
+	if(r==RUN_OK)
+		success(cmd);
+	else if(r==RUN_ERROR)
+		error(cmd);
+}
+
+// Gives the collected line back to the RX buffer
+static void command_release_line()
+{
+	if(cmd_in_rx)
+		serial_rx_consume_line(cmd_len);
+	cmd_in_rx= false;
+}
+
 void command_execute(const char* cmd/*= NULL*/)
 {
 	if(!cmd)
-		cmd= cmd_buf;
+	{
+		command_execute(cmd_line);
+		command_release_line();
+		return;
+	}
 	if(!*cmd || *cmd=='\n' || *cmd=='\r')
 		return; // keep quiet on these
+	command_seq= take_seq();
 
-	// Echo input command
-	print_pstr(">");
-	print_string(cmd);
-	print_pstr("\n");
+	// Queued moves overlap with the next G commands only, the others wait for the queue to be empty
+	bool busy= sequence_is_running() || pending_cmd[0] || (motion_queue_count() && *cmd!='G');
+	if(busy && !is_immediate(*cmd))
+	{
+		if(pending_cmd[0]) // one command only may wait for the sequence to end
+		{
+			info("busy");
+			error(cmd);
+			return;
+		}
+		if(strlen(cmd)>=sizeof(pending_cmd))
+		{
+			error("too long");
+			return;
+		}
+		strncpy(pending_cmd, cmd, sizeof(pending_cmd)-1);
+		pending_cmd[sizeof(pending_cmd)-1]= 0;
+		pending_seq= command_seq;
+		return;
+	}
+	execute(cmd);
+}
 
-	if(run(cmd))
-		success(cmd);
-	else
-		error(cmd);
+// Called from the main loop: reports the queued moves, steps the running sequence, then runs the command which was waiting for it
+void commands_poll()
+{
+	uint8_t seq, flushed;
+	uint8_t event= motion_poll(&seq, &flushed);
+	if(event==MOTION_DONE)
+		info_motion("done", seq);
+	else if(event==MOTION_LIMIT)
+	{
+		info_motion("limit_hit", seq);
+		if(flushed) // the moves queued after it, in order
+		{
+			print_string(";cancelled:");
+			print_uint8_base10(flushed);
+			print_char('\n');
+		}
+	}
+	sequence_poll();
+	if(pending_cmd[0] && !sequence_is_running() && !motion_queue_count() && !nmi_reset)
+	{
+		command_seq= pending_seq;
+		execute(pending_cmd);
+		pending_cmd[0]= 0;
+	}
+}
+
+// Runs a binary frame (see protocol.h): no parsing, the arguments are fixed point integers
+static uint8_t run_frame()
+{
+	uint8_t op= protocol_op();
+	uint8_t n= protocol_arg_count();
+	bool busy= sequence_is_running() || pending_cmd[0] || motion_queue_count();
+
+	switch(op)
+	{
+	case PROTO_OP_STATUS:
+		if(n) break;
+		protocol_reply(PROTO_OK);
+		status_send_frame();
+		return PROTO_OK;
+
+	case PROTO_OP_CANCEL:
+		if(n) break;
+		if(!motion_queue_cancel())
+			sequence_cancel();
+		return PROTO_OK;
+
+	case PROTO_OP_MOVE:
+	{
+		if(n!=5) break;
+		uint8_t axis= protocol_arg_u8(0);
+		if(axis>2 && axis!=MOTION_ALL_AXES) break;
+		if(sequence_is_running() || pending_cmd[0]) return PROTO_BUSY;
+		if(!stepper_are_powered()) return PROTO_ERROR;
+		return motion_queue_push(axis, protocol_arg_i32(1) * 0.001, speed_factor, protocol_seq()) ? PROTO_OK : PROTO_BUSY;
+	}
+
+	case PROTO_OP_STOP:
+		if(n) break;
+		motion_queue_cancel();
+		steppers_settle_here();
+		return PROTO_OK;
+	}
+
+	// The following ones need the sequences and the queued moves to be over
+	if(busy)
+		return PROTO_BUSY;
+	switch(op)
+	{
+	case PROTO_OP_SPEED:
+		if(n!=4) break;
+		speed_factor= protocol_arg_i32(0) * 0.001;
+		return PROTO_OK;
+
+	case PROTO_OP_POWER:
+		if(n!=1 || protocol_arg_u8(0)>1) break;
+		stepper_power(protocol_arg_u8(0));
+		return PROTO_OK;
+
+	case PROTO_OP_HOME:
+	{
+		if(n!=1) break;
+		static const char* const home_cmds[]= { "h", "H", "hf" };
+		uint8_t mode= protocol_arg_u8(0);
+		if(mode>2) break;
+		stepper_power(true);
+		if(!sequence_start(mode==2 ? SEQ_HOME_FAST : SEQ_HOME, 0, mode==0, home_cmds[mode]))
+			return PROTO_ERROR;
+		return PROTO_PENDING;
+	}
+
+	case PROTO_OP_ZERO:
+		if(n) break;
+		set_origin();
+		return PROTO_OK;
+	}
+	return PROTO_BAD_FRAME;
+}
+
+static void command_execute_frame()
+{
+	uint8_t result= run_frame();
+	if(protocol_op()!=PROTO_OP_STATUS || result!=PROTO_OK)
+		protocol_reply(result);
+}
+
+void commands_reset()
+{
+	sequence_abort();
+	motion_queue_reset();
+	pending_cmd[0]= 0;
 }
 
@@ -8,9 +8,22 @@
 #ifndef COMMANDS_H_
 #define COMMANDS_H_
 
+#define COMMAND_KEPT_LENGTH	32	// commands kept for later: deferred, or acknowledged when their sequence ends
+
 bool command_collect();
 void command_execute(const char* cmd= NULL);
+void commands_poll();
+void commands_reset();
 void load_axes_offsets();
 void save_axes_offsets();
+void load_verbosity();
+
+extern float axis_offsets[3];
+extern uint8_t command_seq;
+
+bool error(const char* cmd);
+void info(const char* cmd);
+void info(const char* cmd, float v);
+bool success(const char* cmd);
 
 #endif /* COMMANDS_H_ */
@@ -7,8 +7,11 @@
 
 //#define USE_EXT_POLLING
 
-// Serial baud rate
-#define BAUD_RATE 115200
+// Serial baud rate (may be set from the command line, e.g. make BAUD=250000). At 16 MHz, 250000,
+// 500000 and 1000000 are exact, 115200 is 2.1% off; rates more than 2.5% off are rejected at compile time.
+#ifndef BAUD_RATE
+  #define BAUD_RATE 115200
+#endif
 
 // Default cpu mappings.
 #define CPU_MAP_ATMEGA328P // Arduino Uno
@@ -17,6 +20,30 @@
 // Start in external mode
 #define DEFAULTS_TO_EXTERNAL_MODE
 
+// External step input filtering. On each incoming step edge, the mux lines are sampled until
+// EXT_FILTER_SAMPLES consecutive readings agree (1 disables the filter). The step edge itself is
+// trusted: short master pulses are re-timed. EXT_MUX_SETUP_US adds a fixed wait beforehand,
+// e.g. for long cables or the slow D13 mux line (no pull-up due to the LED).
+#define EXT_FILTER_SAMPLES 2
+#define EXT_MUX_SETUP_US   0
+// Also reject the step when the step line falls back while the mux is sampled (glitch). This sets a
+// minimum master pulse width: EXT_MUX_SETUP_US plus EXT_FILTER_SAMPLES mux readings.
+// #define EXT_FILTER_STEP_GLITCHES // Default disabled. Uncomment to enable.
+
+// Endstop debouncing, per axis (in ms ticks of the main timebase). A limit triggers on its very
+// first edge, then its pin change interrupt is muted and the timebase integrates the pin state:
+// the limit is only released once it has been integrated back to zero (i.e. quiet long enough).
+#define LIMIT_DEBOUNCE_MS { 20, 20, 20 }
+
+// Real-time command characters: acted upon in the serial RX interrupt, never stored in the RX buffer
+// (except inside the binary frames, where they are data). Ctrl-X (0x18) resets.
+#define CMD_FEED_HOLD          0x81 // decelerate and pause the running moves
+#define CMD_CYCLE_START        0x82 // resume
+#define CMD_OVERRIDE_PLUS      0x83 // speed override +10%
+#define CMD_OVERRIDE_MINUS     0x84 // speed override -10%
+#define CMD_OVERRIDE_RESET     0x85 // speed override back to 100%
+#define CMD_STATUS_SNAPSHOT    0x86 // send a telemetry frame right away, even if the telemetry is off
+
 // ---------------------------------------------------------------------------------------
 // ADVANCED CONFIGURATION OPTIONS:
 
@@ -26,7 +53,7 @@
 // increase the receive buffer if a deeper receive buffer is needed for streaming and avaiable
 // memory allows. The send buffer primarily handles messages in Grbl. Only increase if large
 // messages are sent and Grbl begins to stall, waiting to send the rest of the message.
-// NOTE: Buffer size values must be greater than zero and less than 256.
+// NOTE: Buffer size values must be powers of two, up to 128 (see ring.h).
 // #define RX_BUFFER_SIZE 128 // Uncomment to override defaults in serial.h
 // #define TX_BUFFER_SIZE 64
   
@@ -38,6 +65,12 @@
 // As well as, older FTDI FT232RL-based Arduinos(Duemilanove) are known to work with standard
 // terminal programs since their firmware correctly manage these XON/XOFF characters. In any
 // case, please report any successes to grbl administrators!
+// NOTE: the binary frames (status, telemetry, binary protocol) may contain the XON/XOFF characters,
+// do not use them with a host which interprets XON/XOFF in its input stream.
 // #define ENABLE_XONXOFF // Default disabled. Uncomment to enable.
 
+// Hardware flow control: the RTS output (see cpu_map) follows the same RX buffer watermarks
+// (RX_BUFFER_FULL and RX_BUFFER_LOW in serial.h). Connect it to the CTS input of the host adapter.
+// #define ENABLE_RTS // Default disabled. Uncomment to enable.
+
 #endif
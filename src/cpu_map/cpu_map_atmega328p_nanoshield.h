@@ -90,6 +90,11 @@
 #define EXT_ENDSTOP_PORT  PORTC
 #define EXT_ENDSTOP_BIT   3  // Uno Analog Pin 3
 
+// Define the optional RTS output (ENABLE_RTS): low when the controller can receive, high when its RX buffer is full
+#define RTS_DDR           DDRC
+#define RTS_PORT          PORTC
+#define RTS_BIT           4  // Uno Analog Pin 4
+
 // Define user-control controls (cycle start, reset, feed hold) input pins.
 // NOTE: All CONTROLs pins must be on the same port and not on a port with other input pins (limits).
 #define CONTROL_DDR       DDRC
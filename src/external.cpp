@@ -21,12 +21,16 @@
 #include "main.h"
 #include "steppers.h"
 #include "external.h"
+#include "ring.h"
 
 #include "serial.h"
 
 #define POLOLU_DIRECTION_DELAY_US 1 // delay between setting direction and sending puls
 #define POLOLU_PULSE_DURATION_US  3 // length of pulse (1.9us for DRV8825 and 1.0us for A4988)
 
+#define EXT_QUEUE_SIZE            16 // number of incoming steps that can be buffered (bursts from the master)
+#define EXT_STEP_PERIOD_US        10 // Timer2 period, i.e. minimum time between two re-timed step pulses
+
 // Incoming !enable signal state
 #define RT_DISABLED(pin)  (pin & (1<<RESET_BIT))
 // Incoming direction signal state
@@ -36,18 +40,124 @@
 // Get the external stepper select value 0,1,2, and 3 for all axes simultaneously)
 #define RT_MUX            ((SEL_MUX_PIN & SEL_MUX_MASK)>>SEL_MUX_MASK_SHIFT)
 
+// Current state of the incoming control signals
+#ifdef CONTROL_INVERT_MASK
+	#define RT_CONTROL()  ((CONTROL_PIN & CONTROL_MASK) ^ CONTROL_INVERT_MASK)
+#else
+	#define RT_CONTROL()  (CONTROL_PIN & CONTROL_MASK)
+#endif
+
 uint8_t external_mode= 0;
 uint8_t external_axis= 3;
 
 static uint8_t prev_pulse_state= 0;
-static uint8_t prev_direction_state= 0;
 
-#if defined(REDUCE_JITTER_DELTA) && (REDUCE_JITTER_DELTA > 0)
-	uint8_t jitter_counter= 0-REDUCE_JITTER_DELTA;
-#endif
+// Direction of each driver as latched by the master: the direction line is only applied to the
+// axis (or axes) selected by the mux when the step is received, so axes can move independently
+static uint8_t ext_directions= 0;
+
+// Incoming steps are not passed through directly: they are queued and re-emitted by Timer2,
+// so that the driver direction setup time and minimum pulse width are always respected
+typedef struct ext_step_event
+{
+	uint8_t steps;		// STEP_PORT bits to pulse
+	uint8_t directions;	// DIRECTION_PORT bits to apply before the pulse
+} ext_step_event;
+
+static Ring<ext_step_event, EXT_QUEUE_SIZE> ext_queue; // pin change interrupt to timer 2 interrupt
+
+static volatile uint16_t ext_queue_overflows= 0;	// steps lost because the queue was full
+static volatile uint16_t ext_late_steps= 0;			// steps that had to wait behind previous ones
+
+static volatile uint16_t ext_rejected_edges= 0;		// mux lines that never settled (or step glitches)
+static volatile uint16_t ext_suspicious_edges= 0;	// steps accepted after the mux lines changed under them
+
+static void ext_queue_reset()
+{
+	uint8_t sreg= SREG;
+	cli();
+	TIMSK2 &= ~bit(OCIE2A);
+	ext_queue.drop_all();
+	ext_queue_overflows= 0;
+	ext_late_steps= 0;
+	ext_rejected_edges= 0;
+	ext_suspicious_edges= 0;
+	SREG= sreg;
+}
+
+// Samples the mux lines until EXT_FILTER_SAMPLES consecutive readings agree. The step edge was already seen:
+// short master pulses are fine (they are re-timed), unless EXT_FILTER_STEP_GLITCHES is set.
+// Returns false when the mux does not settle (or on a step glitch).
+static bool ext_filter_inputs(uint8_t* axis)
+{
+	#if EXT_MUX_SETUP_US > 0
+		_delay_us(EXT_MUX_SETUP_US);
+	#endif
+	uint8_t mux= RT_MUX;
+	uint8_t agreeing= 1;
+	bool suspicious= false;
+	for(uint8_t tries=0; agreeing<EXT_FILTER_SAMPLES; ++tries)
+	{
+		bool rejected= tries >= 4*EXT_FILTER_SAMPLES;
+		#ifdef EXT_FILTER_STEP_GLITCHES
+			rejected= rejected || !RT_STEP(RT_CONTROL());
+		#endif
+		if(rejected)
+		{
+			++ext_rejected_edges;
+			return false;
+		}
+		uint8_t m= RT_MUX;
+		if(m==mux)
+			++agreeing;
+		else
+		{
+			mux= m;
+			agreeing= 1;
+			suspicious= true;
+		}
+	}
+	if(suspicious)
+		++ext_suspicious_edges;
+	*axis= mux;
+	return true;
+}
+
+static void ext_queue_push(uint8_t steps, uint8_t directions)
+{
+	uint8_t sreg= SREG;
+	cli();
+	bool late= !ext_queue.empty();
+	ext_step_event e;
+	e.steps= steps;
+	e.directions= directions;
+	if(!ext_queue.push(e))
+		++ext_queue_overflows; // the master is too fast for too long: drop this step
+	else
+	{
+		if(late)
+			++ext_late_steps;
+
+		// Wake up the re-timing timer if it was idle (fires within a couple of counts)
+		if(!(TIMSK2 & bit(OCIE2A)))
+		{
+			TCNT2= OCR2A - 1;
+			TIFR2= bit(OCF2A);
+			TIMSK2 |= bit(OCIE2A);
+		}
+	}
+	SREG= sreg;
+}
 
 void external_init()
 {
+	// Timer2 re-emits the queued steps (CTC, 1/8 prescaler), it is armed on demand
+	TCCR2A= bit(WGM21);
+	TCCR2B= bit(CS21);
+	OCR2A= EXT_STEP_PERIOD_US * (F_CPU / 8 / 1000000) - 1;
+	ext_queue_reset();
+	ext_directions= DIRECTION_PORT & DIRECTION_MASK;
+
 	// Start, reset, feed hold
 	CONTROL_DDR		&= ~(CONTROL_MASK); 	// Configure as input pins
 	CONTROL_PORT	|= CONTROL_MASK;  		// Enable internal pull-up resistors. Normal high operation.
@@ -93,6 +203,26 @@ void set_external_stepper_mode(bool state)
 	}
 }
 
+uint16_t external_get_queue_overflows()
+{
+	return ext_queue_overflows;
+}
+
+uint16_t external_get_late_steps()
+{
+	return ext_late_steps;
+}
+
+uint16_t external_get_rejected_edges()
+{
+	return ext_rejected_edges;
+}
+
+uint16_t external_get_suspicious_edges()
+{
+	return ext_suspicious_edges;
+}
+
 void set_external_endstop(bool state)
 {
 	// Marlin: endstop is triggered with a low state
@@ -110,49 +240,58 @@ ISR(CONTROL_INT_vect)
 #endif
 {
 	// The master sent a signal
-	#ifdef CONTROL_INVERT_MASK
-		uint8_t pin = (CONTROL_PIN & CONTROL_MASK) ^ CONTROL_INVERT_MASK;
-	#else
-		uint8_t pin = (CONTROL_PIN & CONTROL_MASK);
-	#endif
-
-	// Check axis direction state
-	#if defined(REDUCE_JITTER_DELTA) && (REDUCE_JITTER_DELTA > 0)
-		counter+= REDUCE_JITTER_DELTA;
-		if(!counter)
-	#endif
-	{
-		uint8_t d= RT_DIRECTION(pin);
-		if(d!=prev_direction_state)
-		{
-			prev_direction_state= d;
-			if(d)
-				DIRECTION_ALL_ON();
-			else
-				DIRECTION_ALL_OFF();
-		}
-	}
+	uint8_t pin = RT_CONTROL();
 
-	// step pulse
+	// step pulse (only the rising edge matters, we generate the pulse ourselves)
 	uint8_t p= RT_STEP(pin);
 	if(p!=prev_pulse_state)
 	{
 		prev_pulse_state= p;
+		if(!p) return;
 
-		uint8_t axis= RT_MUX;
+		uint8_t axis;
+		if(!ext_filter_inputs(&axis))
+			return;
+
+		bool positive= RT_DIRECTION(RT_CONTROL()); // sampled after the filter too
 		if(axis==SEL_MUX_AXIS_ALL) // ref. TRIBED_AXIS_xxx in Tribed Marlin
 		{
-			if(p)
-				STEPPER_ALL_SET();
-			else
-				STEPPER_ALL_CLEAR();
+			ext_directions= positive ? DIRECTION_MASK : 0;
+			ext_queue_push(STEP_MASK, ext_directions);
 		}
-		else // individual axis 0,1 or 2
+		else // individual axis 0,1 or 2: latch its direction only
 		{
-			if(p)
-				STEPPER_SET(axis);
+			if(positive)
+				bset(ext_directions, axis+X_DIRECTION_BIT);
 			else
-				STEPPER_CLEAR(axis);
+				bclr(ext_directions, axis+X_DIRECTION_BIT);
+			ext_queue_push(1<<(axis+X_STEP_BIT), ext_directions);
 		}
 	}
 }
+
+// Re-emits the queued steps with a guaranteed direction setup time and pulse width.
+// The timer stays armed one extra period after the last pulse to guarantee its low time.
+ISR(TIMER2_COMPA_vect)
+{
+	if(ext_queue.empty())
+	{
+		TIMSK2 &= ~bit(OCIE2A); // idle
+		return;
+	}
+
+	const ext_step_event& e= ext_queue.peek();
+	uint8_t directions= e.directions;
+	if((DIRECTION_PORT & DIRECTION_MASK) != directions)
+	{
+		DIRECTION_PORT= (DIRECTION_PORT & ~DIRECTION_MASK) | directions;
+		_delay_us(POLOLU_DIRECTION_DELAY_US);
+	}
+
+	uint8_t steps= e.steps;
+	STEP_PORT |= steps;
+	_delay_us(POLOLU_PULSE_DURATION_US);
+	STEP_PORT &= ~steps;
+
+	ext_queue.consume(1);
+}
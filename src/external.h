@@ -20,4 +20,12 @@ uint8_t is_external_stepper_mode();
 
 void set_external_endstop(bool state);
 
+// Step queue health: steps dropped on overflow, and steps delayed behind previous ones
+uint16_t external_get_queue_overflows();
+uint16_t external_get_late_steps();
+
+// Step input filter health: rejected step edges, and steps accepted while the mux was settling
+uint16_t external_get_rejected_edges();
+uint16_t external_get_suspicious_edges();
+
 #endif /* EXTERNAL_H_ */
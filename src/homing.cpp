@@ -0,0 +1,740 @@
+/*
+ * homing.cpp
+ *
+ *  Homing, calibration and detach sequences. They used to be blocking functions: they are now
+ *  small programs of operations, stepped from the main loop by sequence_poll(), so that status
+ *  queries are still answered and the sequence can be cancelled while it runs.
+ */
+
+#include "main.h"
+#include "homing.h"
+#include "commands.h"
+#include "limits.h"
+#include "serial.h"
+#include "steppers.h"
+
+#define SEEK_COARSE_SPEED_RATIO		0.3		// how fast to seek (first pass)
+#define SEEK_COARSE_LENGTH_MM		400.0	// bed may start completely at the bottom
+
+#define SEEK_FINE_SPEED_RATIO		0.1		// how fast to seek (second pass)
+#define SEEK_LENGTH_MM				1.5		// length to look up again after initial hit and retract
+
+#define SEEK_DOWN_RATIO				1		// how fast to retract (limits are ignored anyway)
+
+// Single pass homing: the ramp down past the trigger point must not be steeper than the regular
+// acceleration ramps (STEPPER_MAX_SPEED over STEPPER_STEPS_TO_FULL_SPEED half steps, i.e. 2.56 mm).
+// The peak deceleration of a linear ramp is about speed^2 / length, so the highest safe ratio is
+// about sqrt(SEEK_FAST_DECEL_MM / 2.56): 0.3 for 0.25 mm, 0.62 for 1 mm.
+#define SEEK_FAST_SPEED_RATIO		0.6		// how fast to seek (single pass homing)
+#define SEEK_FAST_DECEL_MM			1.0		// distance to decelerate past the trigger point (single pass homing)
+
+// Sensors settling: we go on as soon as the sensors are quiet, the times below are upper bounds only
+#define SEEK_DOWN_SETTLE_HOME_MS	200		// max time to wait in low state before homing (make sure the end stops are off)
+#define SEEK_DOWN_SETTLE_LONG_MS	400		// max initial time to wait before seeking up first time
+#define SEEK_DOWN_SETTLE_SHORT_MS	150		// max time to wait before seeking up again slowly
+#define SEEK_SETTLE_QUIET_MS		30		// the sensors are settled once released for this long
+
+#define BENCH_HOME_AWAY_MM			2.0		// homing benchmark: distance to move away from the end stops between cycles
+
+#define ALL_AXES					0x07
+
+// Operations, followed by one argument byte in the programs
+#define OP_END				0
+#define OP_INFO				1	// print a message (arg: MSG_xxx)
+#define OP_REPORT_MS		2	// print a message and the sequence duration (arg: MSG_xxx)
+#define OP_LIMITS_ENABLE	3
+#define OP_DOWN				4	// all axes down by SEEK_LENGTH_MM, limits ignored (arg: SPEED_xxx)
+#define OP_DOWN_AXIS		5	// same for the sequence axis only
+#define OP_SETTLE			6	// wait for the sensors to be quiet (arg: SETTLE_xxx)
+#define OP_SEEK				7	// all axes up until any limit triggers (arg: SEEK_xxx)
+#define OP_SEEK_AXIS		8	// the sequence axis up until its limit triggers (fine)
+#define OP_SEEK_EACH		9	// all axes up, each one stopping on its own limit (fine)
+#define OP_SEEK_FAST		10	// all axes up fast, and decelerate past the first trigger
+#define OP_RETURN_LATCH		11	// back to the position latched by OP_SEEK_FAST
+#define OP_DETACH			12	// all axes down until no sensor is active
+#define OP_DETACH_AXIS		13	// the sequence axis down until its sensor is released
+#define OP_DETACH_EACH		14	// each axis down until its own sensor is released
+#define OP_CHECK_DETACHED	15	// fails if a sensor is still active
+#define OP_OFFSET_AXIS		16	// apply the offset of the sequence axis
+#define OP_OFFSETS			17	// apply the offsets of all axes in one move
+#define OP_ORIGIN			18	// zero all axes
+#define OP_ZERO_AXIS		19	// zero the sequence axis
+#define OP_BENCH_START		20	// clear the benchmark statistics
+#define OP_BENCH_MOVE		21	// all axes by the benchmark distance (arg: BENCH_xxx)
+#define OP_BENCH_RECORD		22	// end of a cycle: record its time and the latched positions (homing)
+#define OP_BENCH_LOOP		23	// back to an operation while cycles remain (arg: operation index)
+#define OP_BENCH_REPORT		24	// (arg: MSG_xxx, the benchmark name)
+#define OP_IF_SLOW			0x80 // flag: skipped unless in "slow but safe" mode
+
+#define SPEED_DOWN			0
+#define SPEED_COARSE		1
+
+#define SEEK_COARSE			0
+#define SEEK_FINE			1
+
+#define SETTLE_HOME			0
+#define SETTLE_LONG			1
+#define SETTLE_SHORT		2
+#define SETTLE_PHASE		3	// long in "slow but safe" mode, else short
+
+#define BENCH_AWAY			0	// down, limits ignored when homing
+#define BENCH_BACK			1	// up again
+
+// Operation results
+#define OP_RUNNING			0
+#define OP_DONE				1
+#define OP_FAILED			2
+#define OP_JUMPED			3	// the operation moved to another one
+
+enum { MSG_H_COARSE, MSG_H_FINE, MSG_H_FAST, MSG_H_ORIGIN, MSG_H_MS, MSG_CN_COMMON, MSG_CN_FINE, MSG_CN_OFFSET,
+	MSG_CA_COMMON, MSG_CA_FINE, MSG_CA_OFFSET, MSG_CA_MS, MSG_BENCH_HOME, MSG_BENCH_HOME_FAST, MSG_BENCH_MOVE };
+
+// The programs and their messages live in flash (see seq_info())
+static const char msg_h_coarse[] PROGMEM= "h/coarse";
+static const char msg_h_fine[] PROGMEM= "h/fine";
+static const char msg_h_fast[] PROGMEM= "h/fast";
+static const char msg_h_origin[] PROGMEM= "h/origin";
+static const char msg_h_ms[] PROGMEM= "h/ms=";
+static const char msg_cn_common[] PROGMEM= "cn/common";
+static const char msg_cn_fine[] PROGMEM= "cn/fine";
+static const char msg_cn_offset[] PROGMEM= "cn/offset";
+static const char msg_ca_common[] PROGMEM= "ca/common";
+static const char msg_ca_fine[] PROGMEM= "ca/fine";
+static const char msg_ca_offset[] PROGMEM= "ca/offset";
+static const char msg_ca_ms[] PROGMEM= "ca/ms=";
+static const char msg_bench_home[] PROGMEM= "bench=home";
+static const char msg_bench_home_fast[] PROGMEM= "bench=home_fast";
+static const char msg_bench_move[] PROGMEM= "bench=move";
+
+static const char* const messages[] PROGMEM= { msg_h_coarse, msg_h_fine, msg_h_fast, msg_h_origin, msg_h_ms, msg_cn_common,
+	msg_cn_fine, msg_cn_offset, msg_ca_common, msg_ca_fine, msg_ca_offset, msg_ca_ms, msg_bench_home, msg_bench_home_fast,
+	msg_bench_move };
+
+/**
+ * 3-way simultaneous homing and origin ("standard homing", may occur after calibration)
+ * Contrary to calibration, we are NOT applying any offsets after homing!
+ * Why? The external master may rely directly on the end stop signals,
+ * so he will have to deal with overall bed offset himself!
+ */
+static const uint8_t program_home[] PROGMEM=
+{
+	OP_LIMITS_ENABLE, 0,
+	OP_IF_SLOW|OP_DOWN, SPEED_COARSE,
+	OP_IF_SLOW|OP_SETTLE, SETTLE_HOME,	// dynamic FSR sensors stabilization (idle)
+	OP_INFO, MSG_H_COARSE,				// long, coarse upwards seek (first home seek)
+	OP_SEEK, SEEK_COARSE,
+	OP_DETACH, 0,
+	OP_DOWN, SPEED_DOWN,				// down by a little bit again to redo a finer seek
+	OP_SETTLE, SETTLE_SHORT,
+	OP_INFO, MSG_H_FINE,				// seek for limit switch upwards again, but slower (fine seek)
+	OP_SEEK, SEEK_FINE,
+	OP_DETACH, 0,
+	OP_INFO, MSG_H_ORIGIN,
+	OP_ORIGIN, 0,
+	OP_REPORT_MS, MSG_H_MS,
+	OP_END, 0
+};
+
+/**
+ * Single pass homing: one fast seek, the limit interrupt latches the trigger position while the axes
+ * decelerate past the switch over a bounded distance, then the bed comes back to the latched position.
+ * As for standard homing, the first axis to trigger defines the origin of all axes (and no offsets).
+ */
+static const uint8_t program_home_fast[] PROGMEM=
+{
+	OP_LIMITS_ENABLE, 0,
+	OP_DETACH, 0,						// start away from the sensors
+	OP_CHECK_DETACHED, 0,
+	OP_INFO, MSG_H_FAST,
+	OP_SEEK_FAST, 0,
+	OP_RETURN_LATCH, 0,
+	OP_INFO, MSG_H_ORIGIN,
+	OP_ORIGIN, 0,
+	OP_REPORT_MS, MSG_H_MS,
+	OP_END, 0
+};
+
+static const uint8_t program_calibrate_axis[] PROGMEM=
+{
+	OP_LIMITS_ENABLE, 0,
+	OP_IF_SLOW|OP_DOWN, SPEED_DOWN,
+	OP_IF_SLOW|OP_SETTLE, SETTLE_LONG,	// stabilize dynamic sensors
+	OP_INFO, MSG_CN_COMMON,				// grouped coarse upwards (aka homing without setting origins)
+	OP_SEEK, SEEK_COARSE,
+	OP_DETACH, 0,
+	OP_DOWN_AXIS, SPEED_DOWN,			// lower the individual axis slightly
+	OP_SETTLE, SETTLE_PHASE,			// add enough time for the sensors to forget the last pressure level
+	OP_INFO, MSG_CN_FINE,				// fine seek end stop upwards for this axis
+	OP_SEEK_AXIS, 0,
+	OP_DETACH_AXIS, 0,
+	OP_OFFSET_AXIS, 0,					// eventually, apply axis-specific retraction (stored in EEPROM)
+	OP_INFO, MSG_CN_OFFSET,				// numerically, we say we are back at the same height as the reference axis,
+	OP_ZERO_AXIS, 0,					// i.e. zero since we homed in the first place
+	OP_END, 0
+};
+
+/**
+ * Calibrate the three axes in one cycle: common coarse seek, then each axis fine seeks its own end stop
+ * simultaneously, and all the axis offsets are applied in a single move before setting the origin.
+ */
+static const uint8_t program_calibrate_all[] PROGMEM=
+{
+	OP_LIMITS_ENABLE, 0,
+	OP_IF_SLOW|OP_DOWN, SPEED_DOWN,
+	OP_IF_SLOW|OP_SETTLE, SETTLE_LONG,	// stabilize dynamic sensors
+	OP_INFO, MSG_CA_COMMON,				// grouped coarse upwards (aka homing without setting origins)
+	OP_SEEK, SEEK_COARSE,
+	OP_DETACH, 0,
+	OP_DOWN, SPEED_DOWN,				// lower all axes slightly
+	OP_SETTLE, SETTLE_PHASE,
+	OP_INFO, MSG_CA_FINE,				// fine seek of all end stops at once, each axis stopping on its own
+	OP_SEEK_EACH, 0,
+	OP_DETACH_EACH, 0,
+	OP_INFO, MSG_CA_OFFSET,
+	OP_OFFSETS, 0,
+	OP_ORIGIN, 0,
+	OP_REPORT_MS, MSG_CA_MS,
+	OP_END, 0
+};
+
+/**
+ * Move bed down until sensors are no more activated.
+ * The usual context is to call this *immediately* after homing up and before setting home with z
+ */
+static const uint8_t program_detach[] PROGMEM=
+{
+	OP_DETACH, 0,
+	OP_CHECK_DETACHED, 0,
+	OP_END, 0
+};
+
+static const uint8_t program_detach_axis[] PROGMEM=
+{
+	OP_DETACH_AXIS, 0,
+	OP_END, 0
+};
+
+/**
+ * Homing repeatability: coarse homing to get an origin, then cycles of [move away, coarse seek, fine seek]
+ * with each axis stopping on its own end stop. The latched positions are recorded on each cycle, the origin is kept.
+ */
+static const uint8_t program_bench_home[] PROGMEM=
+{
+	OP_LIMITS_ENABLE, 0,
+	OP_SEEK, SEEK_COARSE,
+	OP_DETACH, 0,
+	OP_ORIGIN, 0,
+	OP_BENCH_START, 0,
+	OP_BENCH_MOVE, BENCH_AWAY,			// op #5: cycle start
+	OP_SETTLE, SETTLE_PHASE,
+	OP_SEEK, SEEK_COARSE,
+	OP_DETACH, 0,
+	OP_DOWN, SPEED_DOWN,
+	OP_SETTLE, SETTLE_PHASE,
+	OP_SEEK_EACH, 0,
+	OP_BENCH_RECORD, 0,
+	OP_DETACH_EACH, 0,
+	OP_BENCH_LOOP, 5,
+	OP_BENCH_REPORT, MSG_BENCH_HOME,
+	OP_END, 0
+};
+
+/**
+ * Single pass homing repeatability, to compare with the two pass one above: a first single pass homing sets
+ * the origin, then cycles of [move away, fast seek, back to the latch]. The latched positions are recorded
+ * for the axes which triggered (the others may stop before their end stop, within the deceleration distance).
+ */
+static const uint8_t program_bench_home_fast[] PROGMEM=
+{
+	OP_LIMITS_ENABLE, 0,
+	OP_DETACH, 0,
+	OP_CHECK_DETACHED, 0,
+	OP_SEEK_FAST, 0,
+	OP_RETURN_LATCH, 0,
+	OP_ORIGIN, 0,
+	OP_BENCH_START, 0,
+	OP_BENCH_MOVE, BENCH_AWAY,			// op #7: cycle start
+	OP_SETTLE, SETTLE_PHASE,
+	OP_SEEK_FAST, 0,
+	OP_BENCH_RECORD, 0,
+	OP_RETURN_LATCH, 0,
+	OP_BENCH_LOOP, 7,
+	OP_BENCH_REPORT, MSG_BENCH_HOME_FAST,
+	OP_END, 0
+};
+
+// Move throughput: cycles of back and forth moves of the whole bed
+static const uint8_t program_bench_move[] PROGMEM=
+{
+	OP_BENCH_START, 0,
+	OP_BENCH_MOVE, BENCH_AWAY,			// op #1: cycle start
+	OP_BENCH_MOVE, BENCH_BACK,
+	OP_BENCH_RECORD, 0,
+	OP_BENCH_LOOP, 1,
+	OP_BENCH_REPORT, MSG_BENCH_MOVE,
+	OP_END, 0
+};
+
+static const uint8_t* const programs[] PROGMEM= { program_home, program_home_fast, program_calibrate_axis, program_calibrate_all,
+	program_detach, program_detach_axis, program_bench_home, program_bench_move, program_bench_home_fast };
+
+static struct
+{
+	uint8_t cycles;				// cycles to run
+	uint8_t done;				// cycles completed
+	float mm;					// distance moved away on each cycle
+	float speed;
+	uint32_t start_ms;
+	uint32_t cycle_ms;			// current cycle start time
+	uint32_t max_cycle_ms;
+	uint32_t half_steps;		// half steps moved by the benchmark moves (axis 0)
+	int32_t start_position;		// axis 0 position before the current benchmark move
+	int32_t min[3], max[3], sum[3];	// latched trigger positions (half steps)
+	uint8_t latched[3];				// cycles in which the axis triggered
+} bench;
+
+static struct
+{
+	const uint8_t* program;		// running program, NULL when idle
+	const uint8_t* op;			// current operation
+	bool started;				// the current operation has been started
+	uint8_t axis;				// axis for the single axis operations
+	bool slow_but_safe;
+	bool hard_failure;			// a failure resets the controller (homing and calibration are vital)
+	char cmd[COMMAND_KEPT_LENGTH];	// command which started the sequence (acknowledged when it ends)
+	uint8_t reply_seq;			// and its sequence id (streaming mode)
+	uint32_t start_ms;			// sequence start time
+	uint32_t op_ms;				// current operation start time
+	uint32_t quiet_ms;			// last time the sensors were seen active
+	int32_t start_positions[3];	// positions before the single pass seek
+	uint8_t first;				// first axis to trigger during the single pass seek
+	bool respect_endstop;		// stepper modes to restore when the sequence ends
+	bool independent_limits;
+} seq;
+
+// Prints a flash message, e.g. seq_info(PSTR("..."))
+static void seq_info(const char* msg)
+{
+	print_char(';');
+	_print_pstr(msg);
+	print_char('\n');
+}
+
+static void seq_info(const char* msg, float v)
+{
+	print_char(';');
+	_print_pstr(msg);
+	print_float(v);
+	print_char('\n');
+}
+
+static const char* seq_message(uint8_t msg)
+{
+	return (const char*)pgm_read_word(&messages[msg]);
+}
+
+static bool bench_is_homing()
+{
+	return seq.program==program_bench_home || seq.program==program_bench_home_fast;
+}
+
+// Starts a relative movement of the given axes (asynchronous)
+static void seq_move(uint8_t axes, float mm, float speed)
+{
+	Backup<bool> _trm(steppers_relative_mode, true);
+	uint8_t sreg= SREG;
+	cli();
+	for(uint8_t axis=0; axis<3; ++axis)
+		if(axes & (1<<axis))
+			stepper_set_target(axis, mm, speed);
+	SREG= sreg;
+}
+
+static uint16_t seq_settle_max_ms(uint8_t arg)
+{
+	if(arg==SETTLE_PHASE)
+		arg= seq.slow_but_safe ? SETTLE_LONG : SETTLE_SHORT;
+	if(arg==SETTLE_HOME) return SEEK_DOWN_SETTLE_HOME_MS;
+	if(arg==SETTLE_LONG) return SEEK_DOWN_SETTLE_LONG_MS;
+	return SEEK_DOWN_SETTLE_SHORT_MS;
+}
+
+// Starts (first call) or polls an operation
+static uint8_t seq_step(uint8_t op, uint8_t arg)
+{
+	bool start= !seq.started;
+	seq.started= true;
+	uint8_t axis_mask= 1<<seq.axis;
+
+	switch(op)
+	{
+	case OP_INFO:
+		seq_info(seq_message(arg));
+		return OP_DONE;
+
+	case OP_REPORT_MS:
+		seq_info(seq_message(arg), (uint32_t)millis() - seq.start_ms);
+		return OP_DONE;
+
+	case OP_LIMITS_ENABLE:
+		limits_enable();
+		return OP_DONE;
+
+	case OP_DOWN:
+	case OP_DOWN_AXIS:
+		if(start)
+		{
+			steppers_respect_endstop= false;
+			seq_move(op==OP_DOWN ? ALL_AXES : axis_mask, SEEK_LENGTH_MM, arg==SPEED_COARSE ? SEEK_COARSE_SPEED_RATIO : SEEK_DOWN_RATIO);
+		}
+		return steppers_are_moving() ? OP_RUNNING : OP_DONE;
+
+	case OP_SETTLE:
+	{
+		uint32_t now= millis();
+		if(start)
+			seq.op_ms= seq.quiet_ms= now;
+		if(limits_get_rt_states())
+			seq.quiet_ms= now;
+		if(now - seq.quiet_ms < SEEK_SETTLE_QUIET_MS && now - seq.op_ms < seq_settle_max_ms(arg))
+			return OP_RUNNING;
+		seq_info(PSTR("settle="), now - seq.op_ms); // observed settle time
+		return OP_DONE;
+	}
+
+	case OP_SEEK:
+	case OP_SEEK_AXIS:
+	case OP_SEEK_EACH:
+		if(start)
+		{
+			steppers_respect_endstop= true;
+			steppers_independent_limits= (op==OP_SEEK_EACH);
+			sticky_limits= 0;
+			limits_clear_latches(); // record where the limits trigger during this seek
+			if(op==OP_SEEK && arg==SEEK_COARSE)
+				seq_move(ALL_AXES, -SEEK_COARSE_LENGTH_MM, SEEK_COARSE_SPEED_RATIO);
+			else // only 0.5 mm overshoot
+				seq_move(op==OP_SEEK_AXIS ? axis_mask : ALL_AXES, -(SEEK_LENGTH_MM+0.5), SEEK_FINE_SPEED_RATIO);
+		}
+		if(steppers_are_moving())
+			return OP_RUNNING;
+		steppers_settle_here();
+		steppers_independent_limits= seq.independent_limits;
+		if(op==OP_SEEK_EACH) // we want all axes to hit their limit
+			return (sticky_limits & ALL_AXES)==ALL_AXES ? OP_DONE : OP_FAILED;
+		if(op==OP_SEEK_AXIS) // we want this axis to hit the limit
+			return (sticky_limits & axis_mask) ? OP_DONE : OP_FAILED;
+		return sticky_limits ? OP_DONE : OP_FAILED;
+
+	case OP_SEEK_FAST:
+		if(start)
+		{
+			for(uint8_t axis=0; axis<3; ++axis)
+				seq.start_positions[axis]= steppers[axis].position;
+			steppers_respect_endstop= true;
+			sticky_limits= 0;
+			limits_clear_latches();
+			steppers_set_limit_deceleration(SEEK_FAST_DECEL_MM);
+			seq_move(ALL_AXES, -SEEK_COARSE_LENGTH_MM, SEEK_FAST_SPEED_RATIO);
+		}
+		if(steppers_are_moving())
+			return OP_RUNNING;
+		steppers_set_limit_deceleration(0);
+		{
+			// The axis with the shortest travel to its latch triggered first
+			int32_t shortest= 0;
+			seq.first= 0xFF;
+			for(uint8_t axis=0; axis<3; ++axis)
+			{
+				if(!limit_is_latched(axis)) continue;
+				int32_t travel= limit_latches[axis].position - seq.start_positions[axis];
+				if(travel<0) travel= -travel;
+				if(seq.first>2 || travel<shortest)
+				{
+					seq.first= axis;
+					shortest= travel;
+				}
+			}
+		}
+		return seq.first>2 ? OP_FAILED : OP_DONE;
+
+	case OP_RETURN_LATCH:
+		if(start) // all axes moved together
+		{
+			steppers_respect_endstop= false;
+			seq_move(ALL_AXES, limit_get_latched_position(seq.first) - stepper_get_position(seq.first), SEEK_FINE_SPEED_RATIO);
+		}
+		return steppers_are_moving() ? OP_RUNNING : OP_DONE;
+
+	case OP_DETACH:
+		if(start)
+		{
+			steppers_respect_endstop= false; // else no movement may be done ("sticky_limits")
+			if(limits_get_active() || sticky_limits)
+				seq_move(ALL_AXES, 5, 0.01); // very slow: just to detach the bed from the tool head
+		}
+		if(limits_get_active() && steppers_are_moving())
+			return OP_RUNNING;
+		steppers_settle_here(); // stop all movement asap
+		sticky_limits= limits_get_active();
+		return OP_DONE;
+
+	case OP_DETACH_AXIS:
+	case OP_DETACH_EACH:
+	{
+		// TODO: change movement to be short sequences of [down/up/down] to avoid sensor saturation
+		uint8_t axes= (op==OP_DETACH_AXIS) ? axis_mask : ALL_AXES;
+		if(start)
+			steppers_respect_endstop= false;
+		uint8_t active= limits_get_active() & axes;
+		for(uint8_t axis=0; axis<3; ++axis)
+		{
+			uint8_t mask= 1<<axis;
+			if(!(axes & mask))
+				continue;
+			if(!(active & mask))
+				stepper_settle_here(axis); // this one is detached
+			else if(!stepper_is_moving(axis))
+			{
+				sticky_limits &= ~mask;
+				seq_move(mask, 1, 0.01); // down slowly, just to detach the bed from the tool head
+			}
+		}
+		if(active)
+			return OP_RUNNING;
+		sticky_limits &= ~axes;
+		return OP_DONE;
+	}
+
+	case OP_CHECK_DETACHED:
+		return limits_get_active() ? OP_FAILED : OP_DONE;
+
+	case OP_OFFSET_AXIS:
+	case OP_OFFSETS:
+		if(start)
+		{
+			steppers_respect_endstop= seq.respect_endstop;
+			for(uint8_t axis=0; axis<3; ++axis)
+				if(op==OP_OFFSETS || axis==seq.axis)
+					seq_move(1<<axis, axis_offsets[axis], 1);
+		}
+		return steppers_are_moving() ? OP_RUNNING : OP_DONE;
+
+	case OP_ORIGIN:
+		set_origin();
+		sticky_limits= 0;
+		return OP_DONE;
+
+	case OP_ZERO_AXIS:
+		stepper_zero(seq.axis);
+		return OP_DONE;
+
+	case OP_BENCH_START:
+		bench.done= 0;
+		bench.max_cycle_ms= 0;
+		bench.half_steps= 0;
+		memset(bench.latched, 0, sizeof(bench.latched));
+		bench.start_ms= bench.cycle_ms= millis();
+		return OP_DONE;
+
+	case OP_BENCH_MOVE:
+		if(start)
+		{
+			steppers_respect_endstop= bench_is_homing() ? false : seq.respect_endstop;
+			bench.start_position= steppers[0].position;
+			seq_move(ALL_AXES, arg==BENCH_AWAY ? bench.mm : -bench.mm, bench.speed);
+		}
+		if(steppers_are_moving())
+			return OP_RUNNING;
+		{
+			int32_t moved= steppers[0].position - bench.start_position;
+			bench.half_steps+= (moved<0) ? -moved : moved;
+		}
+		return (steppers_respect_endstop && sticky_limits) ? OP_FAILED : OP_DONE;
+
+	case OP_BENCH_RECORD:
+	{
+		uint32_t now= millis();
+		if(now - bench.cycle_ms > bench.max_cycle_ms)
+			bench.max_cycle_ms= now - bench.cycle_ms;
+		bench.cycle_ms= now;
+		if(bench_is_homing())
+			for(uint8_t axis=0; axis<3; ++axis)
+			{
+				if(!limit_is_latched(axis))
+					continue;
+				int32_t position= limit_latches[axis].position;
+				uint8_t n= bench.latched[axis]++;
+				if(!n)
+					bench.min[axis]= bench.max[axis]= bench.sum[axis]= 0;
+				if(!n || position<bench.min[axis]) bench.min[axis]= position;
+				if(!n || position>bench.max[axis]) bench.max[axis]= position;
+				bench.sum[axis]+= position;
+			}
+		++bench.done;
+		return OP_DONE;
+	}
+
+	case OP_BENCH_LOOP:
+		if(bench.done>=bench.cycles)
+			return OP_DONE;
+		seq.op= seq.program + 2*arg;
+		return OP_JUMPED;
+
+	case OP_BENCH_REPORT:
+	{
+		uint32_t ms= millis() - bench.start_ms;
+		seq_info(seq_message(arg));
+		seq_info(PSTR("bench/n="), bench.done);
+		if(bench_is_homing())
+			for(uint8_t axis=0; axis<3; ++axis) // trigger positions: min, max, mean, cycles in which the axis triggered
+			{
+				if(!bench.latched[axis])
+					continue;
+				print_pstr(";bench/a");
+				print_uint8_base10(axis);
+				print_char('=');
+				print_float(stepper_steps_to_mm(bench.min[axis]), 4);
+				print_char(',');
+				print_float(stepper_steps_to_mm(bench.max[axis]), 4);
+				print_char(',');
+				print_float(stepper_steps_to_mm(bench.sum[axis]) / bench.latched[axis], 4);
+				print_char(',');
+				print_uint8_base10(bench.latched[axis]);
+				print_char('\n');
+			}
+		seq_info(PSTR("bench/ms="), ms);
+		seq_info(PSTR("bench/cycle_ms="), (float)ms / bench.done);
+		seq_info(PSTR("bench/max_cycle_ms="), bench.max_cycle_ms);
+		if(ms)
+			seq_info(PSTR("bench/sps="), (float)bench.half_steps * 500 / ms); // full steps per second
+		return OP_DONE;
+	}
+	}
+	return OP_FAILED;
+}
+
+// Restore the stepper modes
+static void sequence_end()
+{
+	steppers_set_limit_deceleration(0);
+	steppers_respect_endstop= seq.respect_endstop;
+	steppers_independent_limits= seq.independent_limits;
+	seq.program= NULL;
+}
+
+static void sequence_finish(bool ok)
+{
+	Backup<uint8_t> _cs(command_seq, seq.reply_seq); // the reply goes to the command which started the sequence
+	sequence_end();
+	if(ok)
+		success(seq.cmd);
+	else
+	{
+		error(seq.cmd);
+		if(seq.hard_failure)
+			nmi_reset= true;
+	}
+}
+
+bool sequence_start(uint8_t sequence, uint8_t axis, bool slow_but_safe, const char* cmd)
+{
+	if(seq.program || sequence>SEQ_BENCH_HOME_FAST)
+		return false;
+	if(strlen(cmd)>=sizeof(seq.cmd)) // the acknowledgement must repeat the command as is
+		return false;
+	seq.program= seq.op= (const uint8_t*)pgm_read_word(&programs[sequence]);
+	seq.started= false;
+	seq.axis= axis;
+	seq.slow_but_safe= slow_but_safe;
+	seq.hard_failure= (sequence<SEQ_DETACH);
+	strcpy(seq.cmd, cmd);
+	seq.reply_seq= command_seq;
+	seq.start_ms= millis();
+	seq.respect_endstop= steppers_respect_endstop;
+	seq.independent_limits= steppers_independent_limits;
+	return true;
+}
+
+// Homing repeatability (SEQ_BENCH_HOME or SEQ_BENCH_HOME_FAST) or move throughput benchmark (SEQ_BENCH_MOVE, by move_mm),
+// run as a sequence
+bool sequence_start_benchmark(uint8_t sequence, uint8_t cycles, float move_mm, float speed_factor, const char* cmd)
+{
+	if(!cycles || sequence<SEQ_BENCH_HOME)
+		return false;
+	bool homing= (sequence!=SEQ_BENCH_MOVE);
+	if(!sequence_start(sequence, 0, false, cmd))
+		return false;
+	bench.cycles= cycles;
+	bench.mm= homing ? BENCH_HOME_AWAY_MM : move_mm;
+	bench.speed= homing ? SEEK_DOWN_RATIO : speed_factor;
+	return true;
+}
+
+// Called from the main loop: runs the current operation, and the next ones as long as they complete at once
+void sequence_poll()
+{
+	while(seq.program && !nmi_reset)
+	{
+		uint8_t op= pgm_read_byte(seq.op);
+		if(op==OP_END)
+		{
+			sequence_finish(true);
+			return;
+		}
+		if(!(op & OP_IF_SLOW) || seq.slow_but_safe)
+		{
+			uint8_t r= seq_step(op & ~OP_IF_SLOW, pgm_read_byte(seq.op+1));
+			if(r==OP_RUNNING)
+				return;
+			if(r==OP_JUMPED)
+			{
+				seq.started= false;
+				continue;
+			}
+			if(r==OP_FAILED)
+			{
+				sequence_finish(false);
+				return;
+			}
+		}
+		seq.op+= 2;
+		seq.started= false;
+	}
+}
+
+bool sequence_is_running()
+{
+	return seq.program!=NULL;
+}
+
+// Stop the running sequence cleanly (the movement stops where it is, the controller is not reset)
+bool sequence_cancel()
+{
+	if(!seq.program)
+		return false;
+	steppers_settle_here();
+	seq_info(PSTR("cancelled"));
+	seq.hard_failure= false;
+	sequence_finish(false);
+	return true;
+}
+
+// Forget the running sequence, e.g. on reset
+void sequence_abort()
+{
+	if(seq.program)
+		sequence_end();
+}
+
+// Progress of the running sequence: command and operation index
+void sequence_report()
+{
+	if(!seq.program)
+		return;
+	print_pstr(";seq=");
+	print_string(seq.cmd);
+	print_char(':');
+	print_uint8_base10((seq.op - seq.program)/2);
+	print_char('\n');
+}
@@ -0,0 +1,29 @@
+/*
+ * homing.h
+ *
+ *  Non-blocking homing, calibration and detach sequences
+ */
+
+#ifndef HOMING_H_
+#define HOMING_H_
+
+// Sequences which can be started
+#define SEQ_HOME				0	// two pass homing (axis 0 is the origin for all)
+#define SEQ_HOME_FAST			1	// single pass homing, with deceleration past the end stops
+#define SEQ_CALIBRATE_AXIS		2	// common seek, then fine seek of one axis and its offset
+#define SEQ_CALIBRATE_ALL		3	// common seek, then fine seek of all axes at once and their offsets
+#define SEQ_DETACH				4	// all axes down until the sensors are released
+#define SEQ_DETACH_AXIS			5	// one axis down until its sensor is released
+#define SEQ_BENCH_HOME			6	// homing repeatability benchmark
+#define SEQ_BENCH_MOVE			7	// move throughput benchmark
+#define SEQ_BENCH_HOME_FAST		8	// single pass homing repeatability benchmark
+
+bool sequence_start(uint8_t sequence, uint8_t axis, bool slow_but_safe, const char* cmd);
+bool sequence_start_benchmark(uint8_t sequence, uint8_t cycles, float move_mm, float speed_factor, const char* cmd);
+void sequence_poll();
+bool sequence_is_running();
+bool sequence_cancel();
+void sequence_abort();
+void sequence_report();
+
+#endif /* HOMING_H_ */
@@ -7,24 +7,51 @@
 
 #include "main.h"
 #include "limits.h"
+#include "steppers.h"
 #include "external.h"
 
 volatile uint8_t sticky_limits= 0;
 
+volatile uint8_t latched_limits= 0;
+volatile limit_latch limit_latches[3];
+
+volatile bool limit_stop_pending= false;
+volatile uint16_t limit_stop_steps= 0;
+volatile uint8_t limit_stop_axes= 0;
+volatile limit_stop_stats limit_stops;
+static uint32_t limit_stop_edge_us= 0;
+
+// Debounced limit states (one bit per axis) and their integrators, see limits_tick()
+static volatile uint8_t debounced_limits= 0;
+static uint8_t limit_integrators[3];
+static const uint8_t limit_debounce_ms[3]= LIMIT_DEBOUNCE_MS;
+
 // Enable hard limits.
 void limits_enable()
 {
+	uint8_t sreg= SREG;
+	cli();
 	LIMIT_PCMSK |= LIMIT_MASK; // PCMSK0 |= 0b00001110; // Uno digital 9,10,11 / Enable specific pins of the Pin Change Interrupt
 	PCICR |= (1 << PCIE0); // Enable Pin Change Interrupt
 	sticky_limits= 0;
+	latched_limits= 0;
+	debounced_limits= 0;
+	set_external_endstop(false);
+	SREG= sreg;
 }
 
 // Disable hard limits.
 void limits_disable()
 {
+	uint8_t sreg= SREG;
+	cli();
 	LIMIT_PCMSK &= ~LIMIT_MASK; // PCMSK0 &= ~0b00001110; // Disable specific pins of the Pin Change Interrupt
 	PCICR  &= ~(1 << PCIE0);  // Disable Pin Change Interrupt
 	sticky_limits= 0;
+	latched_limits= 0;
+	debounced_limits= 0;
+	set_external_endstop(false);
+	SREG= sreg;
 }
 
 void limits_init()
@@ -44,15 +71,158 @@ uint8_t limits_get_rt_states()
   return (LIMIT_PIN & LIMIT_MASK)>>LIMIT_MASK_SHIFT; // (PINB & 0b00001110)>>1;
 }
 
+uint8_t limits_get_states()
+{
+	return debounced_limits;
+}
+
+// Sensors still pressed, either debounced (bouncing contacts) or raw (limits disabled)
+uint8_t limits_get_active()
+{
+	return limits_get_states() | limits_get_rt_states();
+}
+
 bool sticky_limit_is_hit(int axis)
 {
 	return (sticky_limits & (1<<axis));
 }
 
+// Re-arm the position latches (the next trigger edge of each axis will be recorded)
+void limits_clear_latches()
+{
+	latched_limits= 0;
+}
 
-ISR(PCINT0_vect) // DEFAULT: Limit pin change interrupt process.
+bool limit_is_latched(uint8_t axis)
+{
+	return (latched_limits & (1<<axis));
+}
+
+// Position (mm) of the axis when its limit triggered, only meaningful if limit_is_latched()
+float limit_get_latched_position(uint8_t axis)
+{
+	uint8_t sreg= SREG;
+	cli();
+	int32_t position= limit_latches[axis].position;
+	SREG= sreg;
+	return stepper_steps_to_mm(position);
+}
+
+
+// Called from the timebase interrupt (every ms): integrates the state of the triggered limits,
+// and releases them once they have been quiet long enough (clean release edge).
+void limits_tick()
 {
+	uint8_t on= debounced_limits;
+	if(!on) return; // nothing triggered: the pin change interrupt is armed
+
 	uint8_t s= limits_get_rt_states();
-	sticky_limits|= s;
-	set_external_endstop(s!=0); // echo the endstop state to the master
+	for(uint8_t axis=0; axis<3; ++axis)
+	{
+		uint8_t mask= 1<<axis;
+		if(!(on & mask)) continue;
+		if(s & mask)
+		{
+			if(limit_integrators[axis] < limit_debounce_ms[axis])
+				++limit_integrators[axis];
+		}
+		else if(!limit_integrators[axis] || !--limit_integrators[axis])
+		{
+			on &= ~mask;
+			if(limits_are_enforced())
+				LIMIT_PCMSK |= (mask<<LIMIT_MASK_SHIFT); // listen to the next trigger edge again
+		}
+	}
+	debounced_limits= on;
+	if(!on)
+		set_external_endstop(false); // echo the endstop state to the master
+}
+
+
+// True when one of the axes is moving and the limits stop it (i.e. a hard stop will follow)
+static bool limits_stop_expected(uint8_t axes)
+{
+	if(!steppers_respect_endstop || steppers_limit_decelerating)
+		return false;
+	for(uint8_t axis=0; axis<3; ++axis)
+		if((axes & (1<<axis)) && steppers[axis].position!=steppers[axis].target)
+			return true;
+	return false;
+}
+
+// Handles new trigger edges: latches, sticky bits and muting of the pins until they are released.
+// Called with interrupts disabled.
+static void limits_trigger(uint8_t newly)
+{
+	// Latch where (and when) each axis triggered first, as soon as possible
+	uint8_t to_latch= newly & ~latched_limits;
+	if(to_latch)
+	{
+		uint32_t t= millis();
+		for(uint8_t axis=0; axis<3; ++axis)
+			if(to_latch & (1<<axis))
+			{
+				limit_latches[axis].position= steppers[axis].position;
+				limit_latches[axis].time_ms= t;
+			}
+		latched_limits|= to_latch;
+	}
+
+	// Start measuring the hard stop, when a motion is to be stopped by this edge
+	uint8_t axes= steppers_independent_limits ? newly : 0x07;
+	if(!limit_stop_pending && limits_stop_expected(axes))
+	{
+		limit_stop_edge_us= micros();
+		limit_stop_steps= 0;
+		limit_stop_axes= axes;
+		limit_stop_pending= true;
+	}
+
+	sticky_limits|= newly;
+	set_external_endstop(true); // echo the endstop state to the master
+
+	// Mute the triggered pins until they are released by the debouncer
+	for(uint8_t axis=0; axis<3; ++axis)
+		if(newly & (1<<axis))
+			limit_integrators[axis]= limit_debounce_ms[axis];
+	debounced_limits|= newly;
+	LIMIT_PCMSK &= ~(newly<<LIMIT_MASK_SHIFT);
+}
+
+// Processes the trigger edges which are not handled yet, and returns the sticky limits.
+// The stepper interrupt calls it before each pulse, since the pin change interrupt may only
+// be serviced once the stepper interrupt returns. Called with interrupts disabled.
+uint8_t limits_poll()
+{
+	if(limits_are_enforced())
+	{
+		uint8_t newly= limits_get_rt_states() & ~debounced_limits;
+		if(newly)
+			limits_trigger(newly);
+	}
+	return sticky_limits;
+}
+
+// Called by the stepper interrupt when it refuses a pulse because of the limits
+void limits_record_stop()
+{
+	if(!limit_stop_pending) return;
+	limit_stop_pending= false;
+
+	uint32_t latency= micros() - limit_stop_edge_us;
+	if(latency > 0xFFFF) latency= 0xFFFF;
+	++limit_stops.events;
+	if(latency > limit_stops.max_latency_us)
+		limit_stops.max_latency_us= latency;
+	if(limit_stop_steps > limit_stops.max_steps)
+		limit_stops.max_steps= limit_stop_steps;
+}
+
+
+ISR(PCINT0_vect) // DEFAULT: Limit pin change interrupt process.
+{
+	// Only trigger edges matter: bouncing is left to limits_tick()
+	uint8_t newly= limits_get_rt_states() & ~debounced_limits;
+	if(newly)
+		limits_trigger(newly);
 }
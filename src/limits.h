@@ -10,12 +10,44 @@
 
 extern volatile uint8_t sticky_limits;
 
+// Stepper position and time captured by the limit interrupt on the first trigger edge of an axis
+typedef struct limit_latch
+{
+	int32_t position;	// stepper position (half steps) at the trigger edge
+	uint32_t time_ms;	// millis() at the trigger edge
+} limit_latch;
+
+extern volatile uint8_t latched_limits;	// axes which have a valid latch (one bit per axis)
+extern volatile limit_latch limit_latches[3];
+
+// Hard stop instrumentation: time and steps from a limit trigger edge to the motion stop
+typedef struct limit_stop_stats
+{
+	uint16_t events;			// limit events which stopped a motion
+	uint16_t max_latency_us;	// worst time between the trigger edge and the motion stop
+	uint16_t max_steps;			// worst number of steps emitted after the trigger edge
+} limit_stop_stats;
+
+extern volatile bool limit_stop_pending;	// a trigger edge occurred, the motion did not stop yet
+extern volatile uint16_t limit_stop_steps;	// steps emitted since that trigger edge, by the axes it stops
+extern volatile uint8_t limit_stop_axes;	// axes stopped by that trigger edge (one bit per axis)
+extern volatile limit_stop_stats limit_stops;
+
 void limits_enable();
 void limits_disable();
 void limits_init();
 bool limits_are_enforced();
 uint8_t limits_get_rt_states();
+uint8_t limits_get_states(); // debounced
+uint8_t limits_get_active();
+void limits_tick();
+uint8_t limits_poll();
+void limits_record_stop();
 bool sticky_limit_is_hit(int axis);
 
+void limits_clear_latches();
+bool limit_is_latched(uint8_t axis);
+float limit_get_latched_position(uint8_t axis);
+
 
 #endif /* LIMITS_H_ */
@@ -52,6 +52,7 @@ int main(void)
 	millis_init();
 	serial_init();   // Setup serial baud rate and interrupts
 	load_axes_offsets();
+	load_verbosity();
 	limits_init();
 	stepper_init();
 	external_init();
@@ -83,11 +84,14 @@ int main(void)
 			#endif
 			if(command_collect())
 				command_execute();
+			commands_poll();
 		}
 
 		// Here on fatal/reset: retract the bed a little
 		nmi_reset= false;
+		commands_reset(); // forget the running sequence
 		steppers_zero(); // clear all stepper movement
+		steppers_override_reset();
 		limits_enable();
 		external_init();
 
@@ -0,0 +1,126 @@
+/*
+ * protocol.cpp
+ *
+ *  Binary framed commands: collects and checks the frames, sends the replies.
+ *  The commands themselves are run by the command interpreter (see commands.cpp).
+ */
+
+#include "main.h"
+#include "protocol.h"
+#include "serial.h"
+#include <util/crc16.h>
+
+// Collection states
+#define FRAME_IDLE		0
+#define FRAME_LENGTH	1	// sync received
+#define FRAME_DATA		2
+#define FRAME_CRC		3
+
+static uint8_t frame[PROTOCOL_MAX_LENGTH];	// OP, SEQ, ARGS
+static uint8_t frame_state= FRAME_IDLE;
+static uint8_t frame_length= 0;
+static uint8_t frame_count= 0;				// bytes received in frame[]
+static uint8_t frame_crc;
+static uint32_t frame_start_ms;
+
+bool protocol_is_collecting()
+{
+	return frame_state!=FRAME_IDLE;
+}
+
+// Feeds one byte (starting with the sync byte), returns true once a valid frame is complete
+bool protocol_collect(uint8_t c)
+{
+	switch(frame_state)
+	{
+	case FRAME_IDLE:
+		if(c==PROTOCOL_SYNC)
+		{
+			frame_state= FRAME_LENGTH;
+			frame_start_ms= millis();
+		}
+		return false;
+
+	case FRAME_LENGTH:
+		if(c<2 || c>PROTOCOL_MAX_LENGTH)
+		{
+			frame_state= FRAME_IDLE;
+			frame[0]= frame[1]= 0; // unknown op and sequence
+			protocol_reply(PROTO_BAD_FRAME);
+			return false;
+		}
+		frame_length= c;
+		frame_count= 0;
+		frame_crc= _crc8_ccitt_update(0, c);
+		frame_state= FRAME_DATA;
+		return false;
+
+	case FRAME_DATA:
+		frame[frame_count++]= c;
+		frame_crc= _crc8_ccitt_update(frame_crc, c);
+		if(frame_count==frame_length)
+			frame_state= FRAME_CRC;
+		return false;
+	}
+
+	// FRAME_CRC: the frame is complete
+	frame_state= FRAME_IDLE;
+	if(c!=frame_crc)
+	{
+		protocol_reply(PROTO_BAD_CRC);
+		return false;
+	}
+	return true;
+}
+
+// Drops an incomplete frame after PROTOCOL_TIMEOUT_MS
+bool protocol_timeout()
+{
+	if(frame_state==FRAME_IDLE || (uint32_t)millis() - frame_start_ms <= PROTOCOL_TIMEOUT_MS)
+		return false;
+	frame_state= FRAME_IDLE;
+	serial_rx_frame_reset(); // the RX interrupt must not wait for the missing bytes
+	return true;
+}
+
+uint8_t protocol_op()
+{
+	return frame[0];
+}
+
+uint8_t protocol_seq()
+{
+	return frame[1];
+}
+
+uint8_t protocol_arg_count()
+{
+	return frame_length-2;
+}
+
+uint8_t protocol_arg_u8(uint8_t index)
+{
+	return frame[2+index];
+}
+
+int32_t protocol_arg_i32(uint8_t index)
+{
+	const uint8_t* p= frame+2+index;
+	return (int32_t)((uint32_t)p[0] | ((uint32_t)p[1]<<8) | ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24));
+}
+
+void protocol_reply(uint8_t result)
+{
+	uint8_t crc= _crc8_ccitt_update(0, 3);
+	crc= _crc8_ccitt_update(crc, frame[0]);
+	crc= _crc8_ccitt_update(crc, frame[1]);
+	crc= _crc8_ccitt_update(crc, result);
+	serial_begin_frame();
+	serial_write(PROTOCOL_SYNC);
+	serial_write(3);
+	serial_write(frame[0]);
+	serial_write(frame[1]);
+	serial_write(result);
+	serial_write(crc);
+	serial_mark_boundary();
+}
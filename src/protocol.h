@@ -0,0 +1,49 @@
+/*
+ * protocol.h
+ *
+ *  Binary framed commands, alongside the ASCII interpreter
+ *
+ *  Request: SYNC, LEN, OP, SEQ, ARGS[LEN-2], CRC8
+ *  Reply:   SYNC, 3, OP, SEQ, RESULT, CRC8
+ *  The CRC-8 (CCITT, as in avr-libc) covers LEN to the last argument. Integers are little endian.
+ *  The sync byte is only recognized at the start of a line, so the ASCII commands are not affected.
+ */
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#define PROTOCOL_SYNC			0xA7
+#define PROTOCOL_MAX_LENGTH		8		// OP, SEQ and up to 6 argument bytes
+#define PROTOCOL_TIMEOUT_MS		100
+
+// Opcodes
+#define PROTO_OP_STATUS			0x01	// no args: the reply is followed by a binary status frame
+#define PROTO_OP_MOVE			0x02	// axis (u8, 0xFF for the bed), target (i32, um): queued move
+#define PROTO_OP_STOP			0x03	// stop here and drop the queued moves
+#define PROTO_OP_SPEED			0x04	// speed ratio (i32, 1/1000)
+#define PROTO_OP_POWER			0x05	// 0|1 (u8)
+#define PROTO_OP_HOME			0x06	// 0 safe, 1 quick, 2 fast single pass (u8): "$h", "$H" or "$hf" when done
+#define PROTO_OP_CANCEL			0x07	// cancel the running sequence
+#define PROTO_OP_ZERO			0x08	// set the origin here
+
+// Results
+#define PROTO_ERROR				0
+#define PROTO_OK				1
+#define PROTO_PENDING			2		// accepted, completes later
+#define PROTO_BUSY				3		// a sequence or queued moves are running
+#define PROTO_BAD_CRC			4
+#define PROTO_BAD_FRAME			5		// unknown opcode or wrong arguments
+
+bool protocol_is_collecting();
+bool protocol_collect(uint8_t c);
+bool protocol_timeout();
+
+uint8_t protocol_op();
+uint8_t protocol_seq();
+uint8_t protocol_arg_count();
+uint8_t protocol_arg_u8(uint8_t index);
+int32_t protocol_arg_i32(uint8_t index);
+
+void protocol_reply(uint8_t result);
+
+#endif /* PROTOCOL_H_ */
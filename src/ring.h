@@ -0,0 +1,170 @@
+/*
+ * ring.h
+ *
+ *  Single producer / single consumer ring buffer, for the queues shared by an interrupt and the main
+ *  program (or by two interrupts). The size is a power of two up to 128: the head and tail indices are
+ *  free running 8-bit counters, masked on access, so all the slots are usable and the count is just
+ *  head - tail. Each index is only written by its own side, and compiler barriers make sure the data
+ *  is stored before the index which publishes it, and only read after it (AVR has no reordering in hardware).
+ *
+ *  Producer side: push(), space(), write_span() + commit()
+ *  Consumer side: pop(), peek(), at(), read_span() + consume(), drop_all()
+ */
+
+#ifndef RING_H_
+#define RING_H_
+
+#define RING_BARRIER()	__asm__ __volatile__ ("" ::: "memory")
+
+template<typename T, uint8_t SIZE>
+class Ring
+{
+private:
+	typedef char size_must_be_a_power_of_two_up_to_128[((SIZE & (SIZE-1))==0 && SIZE<=128) ? 1 : -1];
+	enum { MASK= SIZE-1 };
+
+	T data[SIZE];
+	volatile uint8_t head;	// written by the producer only
+	volatile uint8_t tail;	// written by the consumer only
+
+public:
+	Ring() : head(0), tail(0) {}
+
+	uint8_t count() const		{ return (uint8_t)(head - tail); }
+	uint8_t space() const		{ return SIZE - count(); }
+	bool empty() const			{ return head == tail; }
+	bool full() const			{ return count() == SIZE; }
+	static uint8_t size()		{ return SIZE; }
+
+	// ---- producer
+
+	bool push(const T& v)
+	{
+		uint8_t h= head;
+		if((uint8_t)(h - tail) == SIZE)
+			return false;
+		data[h & MASK]= v;
+		RING_BARRIER();
+		head= h + 1;
+		return true;
+	}
+
+	// Contiguous free slots from the head (up to the buffer end), to be filled then commit()-ed
+	uint8_t write_span(T** p)
+	{
+		uint8_t h= head;
+		uint8_t n= SIZE - (uint8_t)(h - tail);
+		uint8_t to_end= SIZE - (h & MASK);
+		*p= &data[h & MASK];
+		return n < to_end ? n : to_end;
+	}
+
+	void commit(uint8_t n)
+	{
+		RING_BARRIER();
+		head= head + n;
+	}
+
+	// Pushes up to n items, returns how many were pushed
+	uint8_t push_block(const T* v, uint8_t n)
+	{
+		uint8_t done= 0;
+		while(done < n)
+		{
+			T* p;
+			uint8_t span= write_span(&p);
+			if(!span)
+				break;
+			if(span > n - done)
+				span= n - done;
+			for(uint8_t i=0; i<span; ++i)
+				p[i]= v[done+i];
+			commit(span);
+			done+= span;
+		}
+		return done;
+	}
+
+	// ---- consumer
+
+	bool pop(T& v)
+	{
+		uint8_t t= tail;
+		if(t == head)
+			return false;
+		RING_BARRIER(); // the slot is read after the head which published it
+		v= data[t & MASK];
+		RING_BARRIER();
+		tail= t + 1;
+		return true;
+	}
+
+	// Item at offset from the tail (offset < count(), checked beforehand)
+	const T& peek(uint8_t offset= 0) const
+	{
+		RING_BARRIER(); // not read before that check
+		return data[(uint8_t)(tail + offset) & MASK];
+	}
+
+	// Same, writable: the consumer owns the slots up to the head
+	T& at(uint8_t offset)
+	{
+		return data[(uint8_t)(tail + offset) & MASK];
+	}
+
+	// Contiguous items from the tail (up to the buffer end), to be used then consume()-d
+	uint8_t read_span(const T** p) const
+	{
+		uint8_t t= tail;
+		uint8_t n= (uint8_t)(head - t);
+		RING_BARRIER();
+		uint8_t to_end= SIZE - (t & MASK);
+		*p= &data[t & MASK];
+		return n < to_end ? n : to_end;
+	}
+
+	// Same, writable: the consumer owns the slots up to the head
+	uint8_t read_span(T** p)
+	{
+		uint8_t t= tail;
+		uint8_t n= (uint8_t)(head - t);
+		RING_BARRIER();
+		uint8_t to_end= SIZE - (t & MASK);
+		*p= &data[t & MASK];
+		return n < to_end ? n : to_end;
+	}
+
+	void consume(uint8_t n)
+	{
+		RING_BARRIER();
+		tail= tail + n;
+	}
+
+	// Pops up to n items, returns how many were popped
+	uint8_t pop_block(T* v, uint8_t n)
+	{
+		uint8_t done= 0;
+		while(done < n)
+		{
+			const T* p;
+			uint8_t span= read_span(&p);
+			if(!span)
+				break;
+			if(span > n - done)
+				span= n - done;
+			for(uint8_t i=0; i<span; ++i)
+				v[done+i]= p[i];
+			consume(span);
+			done+= span;
+		}
+		return done;
+	}
+
+	// Drops all the items (consumer side)
+	void drop_all()
+	{
+		tail= head;
+	}
+};
+
+#endif /* RING_H_ */
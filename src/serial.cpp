@@ -21,25 +21,61 @@
 
 #include "main.h"
 #include "serial.h"
-
-uint8_t serial_rx_buffer[RX_BUFFER_SIZE];
-uint8_t serial_rx_buffer_head = 0;
-volatile uint8_t serial_rx_buffer_tail = 0;
-
-uint8_t serial_tx_buffer[TX_BUFFER_SIZE];
-uint8_t serial_tx_buffer_head = 0;
-volatile uint8_t serial_tx_buffer_tail = 0;
+#include "telemetry.h"
+#include "protocol.h"
+#include "steppers.h"
+#include "ring.h"
+
+// Baud rate divider: rounded, with or without the baud doubler (U2X), whichever is the most accurate
+// (the normal mode is preferred when equal, it samples more and is more tolerant). Errors are in per mille.
+#define SERIAL_UBRR_NORMAL		((F_CPU + 8UL*BAUD_RATE) / (16UL*BAUD_RATE) - 1)
+#define SERIAL_UBRR_U2X			((F_CPU + 4UL*BAUD_RATE) / (8UL*BAUD_RATE) - 1)
+#define SERIAL_BAUD_NORMAL		(F_CPU / (16UL*(SERIAL_UBRR_NORMAL+1)))
+#define SERIAL_BAUD_U2X			(F_CPU / (8UL*(SERIAL_UBRR_U2X+1)))
+#define SERIAL_ABS_DIFF(a,b)	((a)>(b) ? (a)-(b) : (b)-(a))
+#define SERIAL_ERROR_NORMAL		(SERIAL_ABS_DIFF(SERIAL_BAUD_NORMAL, BAUD_RATE)*1000UL / BAUD_RATE)
+#define SERIAL_ERROR_U2X		(SERIAL_ABS_DIFF(SERIAL_BAUD_U2X, BAUD_RATE)*1000UL / BAUD_RATE)
+
+#if SERIAL_ERROR_U2X < SERIAL_ERROR_NORMAL
+  #define SERIAL_USE_U2X		1
+  #define SERIAL_ERROR			SERIAL_ERROR_U2X
+#else
+  #define SERIAL_USE_U2X		0
+  #define SERIAL_ERROR			SERIAL_ERROR_NORMAL
+#endif
+#if SERIAL_ERROR > 25
+  #error "BAUD_RATE is more than 2.5% off with this F_CPU"
+#endif
+#if (SERIAL_USE_U2X ? SERIAL_UBRR_U2X : SERIAL_UBRR_NORMAL) > 4095
+  #error "BAUD_RATE is too low for this F_CPU"
+#endif
+
+static Ring<uint8_t, RX_BUFFER_SIZE> serial_rx; // produced by the RX interrupt
+static volatile uint8_t serial_rx_lines_in = 0;   // line ends received (written by the RX interrupt only)
+static uint8_t serial_rx_lines_out = 0;           // line ends consumed (written by the main program only)
+// The RX interrupt follows the binary frames, where the real-time characters are plain data
+#define RX_FRAME_LENGTH 0xFF                      // serial_rx_frame_left: the length byte comes next
+static uint8_t serial_rx_frame_left = 0;          // bytes of the binary frame still to come
+static bool serial_rx_line_start = true;          // a binary frame may start here
+static Ring<uint8_t, TX_BUFFER_SIZE> serial_tx; // consumed by the UDRE interrupt
+static serial_stats serial_link;                // high-water marks: RX written by the RX interrupt, TX by the main program
+#ifdef ENABLE_XONXOFF
+  volatile uint8_t flow_ctrl = XON_SENT; // Flow control state variable
+#endif
+
+volatile bool serial_tx_line_ended = true; // the queued output ends with a complete line (telemetry may be inserted)
+static bool serial_tx_in_frame = false;    // a binary frame is being queued: its 0x0A bytes are not line ends
 
 
 void serial_init()
 {
 	// Set baud rate
-	#if BAUD_RATE < 57600
-		uint16_t UBRR0_value = ((F_CPU / (8L * BAUD_RATE)) - 1)/2 ;
-		UCSR0A &= ~(1 << U2X0); // baud doubler off  - Only needed on Uno XXX
+	#if SERIAL_USE_U2X
+		uint16_t UBRR0_value = SERIAL_UBRR_U2X;
+		UCSR0A |= (1 << U2X0);  // baud doubler on when it is more accurate, i.e. 115200
 	#else
-		uint16_t UBRR0_value = ((F_CPU / (4L * BAUD_RATE)) - 1)/2;
-		UCSR0A |= (1 << U2X0);  // baud doubler on for high baud rates, i.e. 115200
+		uint16_t UBRR0_value = SERIAL_UBRR_NORMAL;
+		UCSR0A &= ~(1 << U2X0); // baud doubler off  - Only needed on Uno XXX
 	#endif
 	UBRR0H = UBRR0_value >> 8;
 	UBRR0L = UBRR0_value;
@@ -49,125 +85,422 @@ void serial_init()
 	
 	// enable interrupt on complete reception of a byte
 	UCSR0B |= 1<<RXCIE0;
+
+	#ifdef ENABLE_RTS
+		RTS_DDR |= (1<<RTS_BIT);
+		RTS_PORT &= ~(1<<RTS_BIT); // ready to receive
+	#endif
 	// defaults to 8-bit, no parity, 1 stop bit
 }
 
 
-// Writes one byte to the TX serial buffer. Called by main program.
-// TODO: Check if we can speed this up for writing strings, rather than single bytes.
-void serial_write(uint8_t data)
+// Wait until there is space in the buffer: this is the output flow control, no fixed delays are needed.
+// Returns the contiguous free span.
+static uint8_t serial_tx_wait(uint8_t** p)
 {
-	// Calculate next head
-	uint8_t next_head = serial_tx_buffer_head + 1;
-	if (next_head == sizeof(serial_tx_buffer))
-		next_head = 0;
+	uint8_t n;
+	while (!(n = serial_tx.write_span(p)))
+	{
+		// With interrupts disabled the UDRE interrupt cannot drain the buffer: send the oldest byte ourselves.
+		// A telemetry frame already started is finished first, it must not be split.
+		if (!(SREG & (1<<SREG_I)) && (UCSR0A & (1<<UDRE0)))
+		{
+			if (telemetry_is_sending())
+				UDR0 = telemetry_next_byte();
+			else
+			{
+				UDR0 = serial_tx.peek();
+				serial_tx.consume(1);
+			}
+		}
+	}
+	return n;
+}
+
+// Publish the n bytes stored in the span, and make sure tx-streaming is running (once per block)
+static inline void serial_tx_commit(uint8_t n, bool line_end)
+{
+	serial_tx.commit(n);
+	uint8_t count = serial_tx.count();
+	if (count > serial_link.tx_high_water)
+		serial_link.tx_high_water = count;
+	if (line_end && !serial_tx_in_frame)
+		serial_tx_line_ended = true;
+	UCSR0B |=  (1 << UDRIE0);
+}
 
-	// Wait until there is space in the buffer
-	while (next_head == serial_tx_buffer_tail)
+// Copies len bytes into the TX buffer, by spans as large as the free space. step is 1, or -1 to
+// copy from the end of data backwards (numbers are converted from the last digit).
+static void serial_tx_copy(const uint8_t *data, uint8_t len, int8_t step)
+{
+	while (len)
 	{
-		// TODO: Restructure st_prep_buffer() calls to be executed here during a long print.
-		// if (sys_rt_exec_state & EXEC_RESET) { return; } // Only check for abort to avoid an endless loop.
+		uint8_t *p;
+		uint8_t n = serial_tx_wait(&p);
+		if (n > len)
+			n = len;
+		len -= n;
+
+		serial_tx_line_ended = false;
+		uint8_t last;
+		for (uint8_t i = 0; i < n; i++)
+		{
+			last = *data;
+			data += step;
+			p[i] = last;
+		}
+		serial_tx_commit(n, last == '\n');
 	}
+}
+
+// Writes one byte to the TX serial buffer. Called by main program.
+void serial_write(uint8_t data)
+{
+	uint8_t *p;
+	serial_tx_wait(&p);
 
 	// Store data and advance head
-	serial_tx_buffer[serial_tx_buffer_head] = data;
-	serial_tx_buffer_head = next_head;
+	serial_tx_line_ended = false;
+	*p = data;
+	serial_tx_commit(1, data == '\n');
+}
 
-	// Enable Data Register Empty Interrupt to make sure tx-streaming is running
-	UCSR0B |=  (1 << UDRIE0);
+// Writes a block of bytes to the TX serial buffer, reserving the space once per block.
+void serial_write_block(const uint8_t *data, uint8_t len)
+{
+	serial_tx_copy(data, len, 1);
+}
+
+void serial_begin_frame()
+{
+	serial_tx_in_frame = true;
+	serial_tx_line_ended = false;
+}
+
+void serial_mark_boundary()
+{
+	serial_tx_in_frame = false;
+	serial_tx_line_ended = true;
+	UCSR0B |=  (1 << UDRIE0); // a telemetry frame may be waiting for it
 }
 
 
 // Data Register Empty Interrupt handler
 ISR(USART_UDRE_vect)
 {
-  uint8_t tail = serial_tx_buffer_tail; // Temporary serial_tx_buffer_tail (to optimize for volatile)
-  
-	// Send a byte from the buffer
-	UDR0 = serial_tx_buffer[tail];
+	#ifdef ENABLE_XONXOFF
+		// Flow control characters go first, even in the middle of a frame
+		if (flow_ctrl == SEND_XOFF) {
+			UDR0 = XOFF_CHAR;
+			flow_ctrl = XOFF_SENT;
+			return;
+		} else if (flow_ctrl == SEND_XON) {
+			UDR0 = XON_CHAR;
+			flow_ctrl = XON_SENT;
+			return;
+		}
+	#endif
+
+	// Telemetry frames are sent whole, and only between two lines of the regular output
+	if (telemetry_is_sending() || (serial_tx.empty() && serial_tx_line_ended && telemetry_is_ready()))
+	{
+		UDR0 = telemetry_next_byte();
+		return;
+	}
 
-	// Update tail position
-	tail++;
-	if (tail == sizeof(serial_tx_buffer))
-		tail = 0;
+	// Nothing to send (a telemetry frame may wait for the end of the current line)
+	uint8_t data;
+	if (!serial_tx.pop(data))
+	{
+		UCSR0B &= ~(1 << UDRIE0);
+		return;
+	}
 
-	serial_tx_buffer_tail = tail;
+	// Send a byte from the buffer
+	UDR0 = data;
 
 	// Turn off Data Register Empty Interrupt to stop tx-streaming if this concludes the transfer
-	if (tail == serial_tx_buffer_head)
+	if (serial_tx.empty() && !(serial_tx_line_ended && telemetry_is_ready()))
 		UCSR0B &= ~(1 << UDRIE0);
 }
 
 
+static inline bool serial_is_line_end(uint8_t c)
+{
+	return c == '\n' || c == '\r';
+}
+
+// Called once bytes were taken from the RX buffer
+static void serial_rx_consumed()
+{
+	#if defined(ENABLE_XONXOFF) || defined(ENABLE_RTS)
+		// Hysteresis: resume the host only once the buffer is back to the low watermark
+		if (serial_get_rx_buffer_count() < RX_BUFFER_LOW)
+		{
+			#ifdef ENABLE_XONXOFF
+				if (flow_ctrl == XOFF_SENT || flow_ctrl == SEND_XOFF) {
+					flow_ctrl = SEND_XON;
+					UCSR0B |=  (1 << UDRIE0); // Force TX
+				}
+			#endif
+			#ifdef ENABLE_RTS
+				RTS_PORT &= ~(1<<RTS_BIT);
+			#endif
+		}
+	#endif
+}
+
 // Fetches the first byte in the serial read buffer. Called by main program.
 uint8_t serial_read()
 {
-	uint8_t tail = serial_rx_buffer_tail; // Temporary serial_rx_buffer_tail (to optimize for volatile)
-	if (serial_rx_buffer_head == tail)
+	uint8_t data;
+	if (!serial_rx.pop(data))
 		return SERIAL_NO_DATA;
+	if (serial_is_line_end(data))
+		serial_rx_lines_out++;
+	serial_rx_consumed();
+	return data;
+}
 
-	uint8_t data = serial_rx_buffer[tail];
+// Complete lines waiting in the RX buffer (the RX interrupt counts the line ends)
+uint8_t serial_rx_line_count()
+{
+	return (uint8_t)(serial_rx_lines_in - serial_rx_lines_out);
+}
 
-	tail++;
-	if (tail == sizeof(serial_rx_buffer))
-		tail = 0;
-	serial_rx_buffer_tail = tail;
+// Byte of the RX buffer at offset, without taking it (offset < serial_get_rx_buffer_count())
+uint8_t serial_rx_peek(uint8_t offset)
+{
+	return serial_rx.peek(offset);
+}
 
-	return data;
+// Length of the first line, line end excluded (a complete line must be waiting)
+uint8_t serial_rx_line_length()
+{
+	uint8_t n = 0;
+	while (!serial_is_line_end(serial_rx.peek(n)))
+		n++;
+	return n;
 }
 
-extern void stepper_power(bool);
+// Same for the line at offset, or 0xFF if its line end was not received yet
+uint8_t serial_rx_find_line_end(uint8_t offset)
+{
+	uint8_t count = serial_rx.count();
+	for (uint8_t n = 0; offset + n < count; n++)
+		if (serial_is_line_end(serial_rx.peek(offset + n)))
+			return n;
+	return 0xFF;
+}
+
+// The first line, in place in the RX buffer and NUL terminated (over its line end), or NULL if it
+// wraps around the end of the buffer. It stays valid until serial_rx_consume_line().
+char* serial_rx_line_in_place(uint8_t len)
+{
+	uint8_t *p;
+	if (serial_rx.read_span(&p) <= len)
+		return NULL;
+	p[len] = 0; // the consumer owns the slots up to the head
+	return (char *)p;
+}
+
+// Copies the first line to dst (len bytes, then NUL)
+void serial_rx_copy_line(char *dst, uint8_t len)
+{
+	for (uint8_t i = 0; i < len; i++)
+		dst[i] = serial_rx.peek(i);
+	dst[len] = 0;
+}
+
+// Drops the first line and its line end
+void serial_rx_consume_line(uint8_t len)
+{
+	serial_rx.consume(len + 1);
+	serial_rx_lines_out++;
+	serial_rx_consumed();
+}
+
+// Copies n bytes at offset to dst and takes them out of the RX buffer, ahead of the bytes before them:
+// these are moved up over the freed slots (they all belong to the consumer)
+void serial_rx_take(uint8_t offset, uint8_t *dst, uint8_t n)
+{
+	for (uint8_t i = 0; i < n; i++)
+	{
+		dst[i] = serial_rx.peek(offset + i);
+		if (serial_is_line_end(dst[i]))
+			serial_rx_lines_out++; // counted by the RX interrupt, even inside a binary frame
+	}
+	for (uint8_t i = offset; i--; )
+		serial_rx.at(i + n) = serial_rx.peek(i);
+	serial_rx.consume(n);
+	serial_rx_consumed();
+}
+
+// The RX buffer is full of a partial line: nothing can complete it.
+// With flow control the host is paused at the high watermark, so the line end never comes either.
+bool serial_rx_is_stuck()
+{
+	#if defined(ENABLE_XONXOFF) || defined(ENABLE_RTS)
+		return serial_get_rx_buffer_count() >= RX_BUFFER_FULL && !serial_rx_line_count();
+	#else
+		return serial_rx.full() && !serial_rx_line_count();
+	#endif
+}
+
+static inline void serial_count(uint16_t& counter)
+{
+	if (counter != 0xFFFF)
+		counter++;
+}
+
+// Follows the binary frames in the stored bytes, as command_collect() will see them (see protocol.h)
+static inline void serial_rx_track_frame(uint8_t data)
+{
+	uint8_t left = serial_rx_frame_left;
+	if (left)
+	{
+		if (left == RX_FRAME_LENGTH)
+			left = (data >= 2 && data <= PROTOCOL_MAX_LENGTH) ? data + 1 : 0; // data and crc, or bad frame
+		else
+			left--;
+		serial_rx_frame_left = left;
+		serial_rx_line_start = !left;
+	}
+	else
+	{
+		if (serial_rx_line_start && data == PROTOCOL_SYNC)
+			serial_rx_frame_left = RX_FRAME_LENGTH;
+		serial_rx_line_start = serial_is_line_end(data);
+	}
+}
+
+// The collector dropped an incomplete frame (timeout): the next byte may start a frame again
+void serial_rx_frame_reset()
+{
+	uint8_t sreg = SREG;
+	cli();
+	serial_rx_frame_left = 0;
+	serial_rx_line_start = true;
+	SREG = sreg;
+}
+
+// Real-time characters, returns false for the other ones
+static inline bool serial_rx_realtime(uint8_t data)
+{
+	switch (data)
+	{
+		case 0x18: // control-X has immediate meaning (reset)
+			stepper_power(false);
+			nmi_reset = true;
+			break;
+		case CMD_FEED_HOLD:       steppers_feed_hold(true); break;
+		case CMD_CYCLE_START:     steppers_feed_hold(false); break;
+		case CMD_OVERRIDE_PLUS:   steppers_override_change(STEPPER_OVERRIDE_STEP); break;
+		case CMD_OVERRIDE_MINUS:  steppers_override_change(-STEPPER_OVERRIDE_STEP); break;
+		case CMD_OVERRIDE_RESET:  steppers_override_change(100 - steppers_get_override()); break;
+		case CMD_STATUS_SNAPSHOT: telemetry_request(); break;
+		default: return false;
+	}
+	return true;
+}
 
 ISR(USART_RX_vect)
 {
+	uint8_t status = UCSR0A; // must be read before UDR0
 	uint8_t data = UDR0;
-	uint8_t next_head;
 
-	if(data==0x18) // control-X has immediate meaning (reset)
+	if (status & (1<<DOR0))
+		serial_count(serial_link.rx_overruns); // one or more bytes lost before this one
+	if (status & (1<<FE0))
 	{
-		stepper_power(false);
-		nmi_reset= true;
-		return;
+		serial_count(serial_link.rx_frame_errors);
+		return; // garbage
 	}
-	if(nmi_reset) return;
 
-	next_head = serial_rx_buffer_head + 1;
-	if (next_head == sizeof(serial_rx_buffer))
-	  next_head = 0;
+	if (!serial_rx_frame_left && serial_rx_realtime(data))
+		return;
+	if(nmi_reset) return;
 
 	// Write data to buffer unless it is full.
-	if (next_head != serial_rx_buffer_tail)
+	if (serial_rx.push(data))
 	{
-		serial_rx_buffer[serial_rx_buffer_head] = data;
-		serial_rx_buffer_head = next_head;
-
+		serial_rx_track_frame(data);
+		if (serial_is_line_end(data))
+			serial_rx_lines_in++; // mark the line boundary
+		uint8_t count = serial_rx.count();
+		if (count > serial_link.rx_high_water)
+			serial_link.rx_high_water = count;
+
+		#if defined(ENABLE_XONXOFF) || defined(ENABLE_RTS)
+			// Stop the host at the high watermark: it may still send a few bytes (FIFO of the USB chip)
+			if (serial_get_rx_buffer_count() >= RX_BUFFER_FULL)
+			{
+				#ifdef ENABLE_XONXOFF
+					if (flow_ctrl == XON_SENT || flow_ctrl == SEND_XON) {
+						flow_ctrl = SEND_XOFF;
+						UCSR0B |=  (1 << UDRIE0); // Force TX
+					}
+				#endif
+				#ifdef ENABLE_RTS
+					RTS_PORT |= (1<<RTS_BIT);
+				#endif
+			}
+		#endif
 	}
+	else
+		serial_count(serial_link.rx_dropped);
 }
 
 void serial_reset_read_buffer() 
 {
-	serial_rx_buffer_tail = serial_rx_buffer_head;
+	uint8_t sreg = SREG;
+	cli();
+	serial_rx.drop_all();
+	serial_rx_lines_out = serial_rx_lines_in;
+	serial_rx_frame_left = 0;
+	serial_rx_line_start = true;
+	SREG = sreg;
+
+	#ifdef ENABLE_XONXOFF
+		if (flow_ctrl != XON_SENT) {
+			flow_ctrl = SEND_XON;
+			UCSR0B |=  (1 << UDRIE0); // Force TX
+		}
+	#endif
+	#ifdef ENABLE_RTS
+		RTS_PORT &= ~(1<<RTS_BIT);
+	#endif
 }
 
 
 // Returns the number of bytes used in the RX serial buffer.
 uint8_t serial_get_rx_buffer_count()
 {
-  uint8_t rtail = serial_rx_buffer_tail; // Copy to limit multiple calls to volatile
-  if (serial_rx_buffer_head >= rtail)
-	  return(serial_rx_buffer_head-rtail);
-  return (sizeof(serial_rx_buffer) - (rtail-serial_rx_buffer_head));
+	return serial_rx.count();
 }
 
 
 // Returns the number of bytes used in the TX serial buffer.
-// NOTE: Not used except for debugging and ensuring no TX bottlenecks.
 uint8_t serial_get_tx_buffer_count()
 {
-	uint8_t ttail = serial_tx_buffer_tail; // Copy to limit multiple calls to volatile
-	if (serial_tx_buffer_head >= ttail)
-		return(serial_tx_buffer_head-ttail);
-	return (sizeof(serial_tx_buffer) - (ttail-serial_tx_buffer_head));
+	return serial_tx.count();
+}
+
+// Copies the link health counters (the RX ones are updated by the interrupt)
+void serial_get_stats(serial_stats* s)
+{
+	uint8_t sreg = SREG;
+	cli();
+	*s = serial_link;
+	SREG = sreg;
+}
+
+void serial_reset_stats()
+{
+	uint8_t sreg = SREG;
+	cli();
+	memset(&serial_link, 0, sizeof(serial_link));
+	SREG = sreg;
 }
 
 
@@ -182,19 +515,36 @@ void print_char(const char s)
 
 void print_string(const char *s)
 {
-	while (*s)
-		serial_write(*s++);
+	size_t len = strlen(s);
+	while (len > 255) // serial_write_block() is limited to 255 bytes
+	{
+		serial_write_block((const uint8_t *)s, 255);
+		s += 255;
+		len -= 255;
+	}
+	serial_write_block((const uint8_t *)s, len);
 }
 
 
-// Print a string stored in PGM-memory
-void _print_pstr(const char *s, int slow_us)
+// Print a string stored in PGM-memory, copied straight into the TX buffer by blocks
+void _print_pstr(const char *s)
 {
-	char c;
-	while ((c = pgm_read_byte_near(s++)))
+	char c = pgm_read_byte_near(s);
+	while (c)
 	{
-		serial_write(c);
-		if(slow_us) delay_us(slow_us);
+		uint8_t *p;
+		uint8_t span = serial_tx_wait(&p);
+
+		serial_tx_line_ended = false;
+		uint8_t n = 0;
+		char last;
+		do
+		{
+			last = c;
+			p[n++] = c;
+			c = pgm_read_byte_near(++s);
+		} while (c && n < span);
+		serial_tx_commit(n, last == '\n');
 	}
 }
 
@@ -211,8 +561,7 @@ void print_unsigned_int8(uint8_t n, uint8_t base, uint8_t digits)
 		n /= base;
 	}
 
-	for (; i > 0; i--)
-		serial_write(buf[i - 1]);
+	serial_tx_copy(buf + i - 1, i, -1);
 }
 
 
@@ -247,12 +596,11 @@ void print_uint32_base10(uint32_t n)
 
 	while (n > 0)
 	{
-		buf[i++] = n % 10;
+		buf[i++] = '0' + n % 10;
 		n /= 10;
 	}
 
-	for (; i > 0; i--)
-		serial_write('0' + buf[i-1]);
+	serial_tx_copy(buf + i - 1, i, -1);
 }
 
 
@@ -307,8 +655,7 @@ void print_float(float n, uint8_t decimal_places)
   }
 
   // Print the generated string.
-  for (; i > 0; i--)
-    serial_write(buf[i-1]);
+  serial_tx_copy(buf + i - 1, i, -1);
 }
 
 
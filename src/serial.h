@@ -24,6 +24,7 @@
 
 #define SERIAL_NO_DATA 0
 
+// Powers of two, up to 128 (see ring.h)
 #ifndef RX_BUFFER_SIZE
   #define RX_BUFFER_SIZE 128
 #endif
@@ -31,9 +32,11 @@
   #define TX_BUFFER_SIZE 128
 #endif
 
-#ifdef ENABLE_XONXOFF
+#if defined(ENABLE_XONXOFF) || defined(ENABLE_RTS)
   #define RX_BUFFER_FULL 96 // XOFF high watermark
   #define RX_BUFFER_LOW 64 // XON low watermark
+#endif
+#ifdef ENABLE_XONXOFF
   #define SEND_XOFF 1
   #define SEND_XON 2
   #define XOFF_SENT 3
@@ -47,9 +50,29 @@ void serial_init();
 // Writes one byte to the TX serial buffer. Called by main program.
 void serial_write(uint8_t data);
 
+// Writes len bytes to the TX serial buffer: the space is reserved and the interrupt enabled once per block.
+void serial_write_block(const uint8_t *data, uint8_t len);
+
+// Brackets a binary frame in the output: no telemetry frame is inserted until serial_mark_boundary(),
+// whatever the frame bytes (a 0x0A byte is not a line end there).
+void serial_begin_frame();
+void serial_mark_boundary();
+
 // Fetches the first byte in the serial read buffer. Called by main program.
 uint8_t serial_read();
 
+// Lines waiting in the RX buffer, parsed in place (see command_collect())
+uint8_t serial_rx_line_count();
+uint8_t serial_rx_peek(uint8_t offset= 0);
+uint8_t serial_rx_line_length();
+uint8_t serial_rx_find_line_end(uint8_t offset);
+char* serial_rx_line_in_place(uint8_t len);
+void serial_rx_copy_line(char *dst, uint8_t len);
+void serial_rx_consume_line(uint8_t len);
+void serial_rx_take(uint8_t offset, uint8_t *dst, uint8_t n);
+bool serial_rx_is_stuck();
+void serial_rx_frame_reset();
+
 // Reset and empty data in read buffer. Used by e-stop and reset.
 void serial_reset_read_buffer();
 
@@ -57,18 +80,29 @@ void serial_reset_read_buffer();
 uint8_t serial_get_rx_buffer_count();
 
 // Returns the number of bytes used in the TX serial buffer.
-// NOTE: Not used except for debugging and ensuring no TX bottlenecks.
 uint8_t serial_get_tx_buffer_count();
 
+// Link health: the counters saturate, the high-water marks are buffer fill levels (bytes)
+typedef struct serial_stats
+{
+	uint16_t rx_dropped;		// received while the RX buffer was full
+	uint16_t rx_overruns;		// lost in the hardware (DOR0: the RX interrupt was held off too long)
+	uint16_t rx_frame_errors;	// bad stop bit (FE0: baud rate mismatch or line noise)
+	uint8_t rx_high_water;
+	uint8_t tx_high_water;
+} serial_stats;
+
+void serial_get_stats(serial_stats* s);
+void serial_reset_stats();
+
 // ======================== PRINTING ROUTINES
 
 void print_char(const char s);
 
 void print_string(const char *s);
 
-#define print_pstr(s) _print_pstr(PSTR(s), 0)
-#define print_pstr_slow(s) _print_pstr(PSTR(s), 100)
-void _print_pstr(const char *s, int slow_us=0);
+#define print_pstr(s) _print_pstr(PSTR(s))
+void _print_pstr(const char *s);
 
 void print_integer(long n);
 
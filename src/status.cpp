@@ -0,0 +1,85 @@
+/*
+ * status.cpp
+ *
+ *  Compact status reports: a single line, or a fixed size binary frame. Both carry the power state,
+ *  the modes, the limit bits and the three positions, and are cheap enough to be polled at 100+ Hz.
+ */
+
+#include "main.h"
+#include "status.h"
+#include "serial.h"
+#include "limits.h"
+#include "steppers.h"
+#include "homing.h"
+#include <util/crc16.h>
+
+// Also called from the telemetry (timer interrupt)
+void status_take(status_snapshot* s)
+{
+	int32_t positions[3];
+	uint8_t sreg= SREG;
+	cli(); // consistent positions and limits
+	for(uint8_t axis=0; axis<3; ++axis)
+		positions[axis]= steppers[axis].position;
+	s->sticky= sticky_limits;
+	s->rt= limits_get_rt_states();
+	SREG= sreg;
+
+	s->flags= 0;
+	if(stepper_are_powered())	s->flags|= STATUS_POWERED;
+	if(steppers_relative_mode)	s->flags|= STATUS_RELATIVE;
+	if(limits_are_enforced())	s->flags|= STATUS_LIMITS_ON;
+	if(steppers_are_moving())	s->flags|= STATUS_MOVING;
+	if(sequence_is_running() || motion_queue_count())
+		s->flags|= STATUS_BUSY;
+	if(steppers_is_held())		s->flags|= STATUS_HELD;
+
+	for(uint8_t axis=0; axis<3; ++axis) // half steps are 2.5 um
+		s->positions_um[axis]= positions[axis]*5/2;
+}
+
+// ;s=<flags>,<sticky limits>,<rt limits>,<um>,<um>,<um>
+void status_print_line()
+{
+	status_snapshot s;
+	status_take(&s);
+	print_pstr(";s=");
+	print_uint8_base10(s.flags);
+	print_char(',');
+	print_uint8_base10(s.sticky);
+	print_char(',');
+	print_uint8_base10(s.rt);
+	for(uint8_t axis=0; axis<3; ++axis)
+	{
+		print_char(',');
+		print_integer(s.positions_um[axis]);
+	}
+	print_char('\n');
+}
+
+static uint8_t status_write(uint8_t crc, uint8_t b)
+{
+	serial_write(b);
+	return _crc8_ccitt_update(crc, b);
+}
+
+// Fixed size frame, the crc covers the length and the payload
+void status_send_frame()
+{
+	status_snapshot s;
+	status_take(&s);
+	serial_begin_frame();
+	serial_write(STATUS_FRAME_SYNC);
+	uint8_t crc= status_write(0, STATUS_FRAME_LENGTH);
+	crc= status_write(crc, s.flags);
+	crc= status_write(crc, s.sticky);
+	crc= status_write(crc, s.rt);
+	for(uint8_t axis=0; axis<3; ++axis)
+	{
+		uint32_t v= s.positions_um[axis];
+		for(uint8_t i=0; i<4; ++i, v>>=8)
+			crc= status_write(crc, v & 0xFF);
+	}
+	serial_write(crc);
+	serial_mark_boundary();
+}
@@ -0,0 +1,34 @@
+/*
+ * status.h
+ *
+ *  Compact status reports, for masters polling at a high rate
+ */
+
+#ifndef STATUS_H_
+#define STATUS_H_
+
+// Status flags (first field of the compact reports)
+#define STATUS_POWERED			0x01	// steppers are powered
+#define STATUS_RELATIVE			0x02	// relative mode
+#define STATUS_LIMITS_ON		0x04	// limits are enforced
+#define STATUS_MOVING			0x08	// at least one axis is moving
+#define STATUS_BUSY				0x10	// a sequence or queued moves are running
+#define STATUS_HELD				0x20	// feed hold (real-time character)
+
+// Binary frame: sync, length, flags, sticky limits, real time limits, 3 x int32 positions (um, little endian), crc8
+#define STATUS_FRAME_SYNC		0xA5
+#define STATUS_FRAME_LENGTH		(3 + 3*4)	// payload bytes (between the length and the crc)
+
+typedef struct status_snapshot
+{
+	uint8_t flags;
+	uint8_t sticky;
+	uint8_t rt;
+	int32_t positions_um[3];
+} status_snapshot;
+
+void status_take(status_snapshot* s);
+void status_print_line();
+void status_send_frame();
+
+#endif /* STATUS_H_ */
@@ -30,9 +30,10 @@ D (digital pins 0 to 7)
 #include "limits.h"
 #include "serial.h"
 #include "external.h"
+#include "ring.h"
 
 #define STEPS_PER_MM				200		// how many steps for 1 mm (depends on stepper and microstep settings)
-#define MOVE_SHARE_LIMITS					// undefine to have the steppers check only their respective limit when moving (probably unsafe)
+#define MOVE_SHARE_LIMITS					// undefine to have the steppers check only their respective limit when moving by default (probably unsafe)
 
 #define BASE_TIMER_PERIOD			64		// how often the interrupt fires (clk * 8) -- at max speed, half a step can be made on each interrupt -- lowest possible
 
@@ -41,6 +42,10 @@ D (digital pins 0 to 7)
 #define STEPPER_MAX_SPEED			350		// (400) stepper full speed (max. increase to the accumulator on each interrupt)
 #define FIXED_POINT_OVF				256		// (half) movement occurs when accumulator overshoots this value (higher or equal to STEPPER_MAX_SPEED)
 
+// Hard stop guarantee: the limits are checked right before each pulse (see stepper_limited()),
+// so at most the pulse which is in flight when a switch triggers is emitted after the trigger edge
+// (the worst case actually seen is reported by the limit stop statistics, see limits.h).
+
 bool steppers_relative_mode= false;
 
 volatile int32_t stepper_speed= STEPPER_MAX_SPEED;
@@ -48,6 +53,28 @@ volatile int32_t stepper_speed= STEPPER_MAX_SPEED;
 volatile stepper_data steppers[3];
 volatile bool steppers_respect_endstop= true;
 
+// When set, each axis only stops on its own limit (e.g. parallel calibration), else any limit stops all axes
+#ifdef MOVE_SHARE_LIMITS
+	volatile bool steppers_independent_limits= false;
+#else
+	volatile bool steppers_independent_limits= true;
+#endif
+
+// Feed hold and speed override: the speed is scaled by steppers_feed_scale (256 = 100%), which the stepper
+// interrupt slews toward its target one unit every STEPPER_OVERRIDE_SLEW_TICKS interrupts (about 40 ms from
+// 100% to a stop, as steep as the regular acceleration ramps)
+#define FEED_SCALE_ONE					256
+#define STEPPER_OVERRIDE_SLEW_TICKS		5
+static volatile uint8_t steppers_override= 100;		// percent
+static volatile bool steppers_held= false;
+static volatile uint16_t steppers_feed_scale_target= FEED_SCALE_ONE; // 0 when held
+static uint16_t steppers_feed_scale= FEED_SCALE_ONE;	// stepper interrupt only
+static uint8_t steppers_slew_ticks= 0;
+
+// When non zero, a limit does not hard stop the motion: all axes decelerate over this distance instead
+volatile int32_t steppers_limit_decel_steps= 0;
+volatile bool steppers_limit_decelerating= false; // a limit triggered and the axes are decelerating
+
 #define DIRECTION_POS(a)  DIRECTION_PORT |=  (1<<((a)+X_DIRECTION_BIT))
 #define DIRECTION_NEG(a)  DIRECTION_PORT &= ~(1<<((a)+X_DIRECTION_BIT))
 
@@ -196,9 +223,24 @@ bool stepper_set_target(uint8_t axis, float mm, float speed_factor)
 	return true;
  }
 
+// Set the distance over which the axes decelerate when a limit triggers (0 for a hard stop)
+void steppers_set_limit_deceleration(float mm)
+{
+	uint8_t sreg= SREG;
+	cli();
+	steppers_limit_decel_steps= (int32_t)(mm * 2 * STEPS_PER_MM);
+	steppers_limit_decelerating= false;
+	SREG= sreg;
+}
+
+float stepper_steps_to_mm(int32_t steps)
+{
+	return (float)steps / (2 * STEPS_PER_MM);
+}
+
 float stepper_get_position(uint8_t axis)
 {
-	return (float)steppers[axis].position / (2 * STEPS_PER_MM);
+	return stepper_steps_to_mm(steppers[axis].position);
 }
 
 void stepper_override_position(uint8_t axis, float mm)
@@ -217,7 +259,7 @@ int stepper_get_direction(uint8_t axis)
 
 bool stepper_is_moving(uint8_t axis)
 {
-	if(steppers_respect_endstop && (sticky_limits & (1<<axis)))
+	if(steppers_respect_endstop && !steppers_limit_decelerating && (sticky_limits & (1<<axis)))
 		return false;
 	return (steppers[axis].target - steppers[axis].position != 0);
 }
@@ -226,7 +268,13 @@ bool steppers_are_moving()
 {
 	for(int axis=0;axis<3;++axis)
 	{
-		if(steppers_respect_endstop && sticky_limits)
+		if(steppers_independent_limits)
+		{
+			if(stepper_is_moving(axis))
+				return true;
+			continue;
+		}
+		if(steppers_respect_endstop && !steppers_limit_decelerating && sticky_limits)
 			return false;
 		if(steppers[axis].target - steppers[axis].position != 0)
 			return true;
@@ -236,6 +284,85 @@ bool steppers_are_moving()
 
 
 
+// Shorten the movement of all axes to steppers_limit_decel_steps (and ramp down over this distance)
+static void steppers_decelerate()
+{
+	int32_t stop= steppers_limit_decel_steps;
+	for(uint8_t axis=0; axis<3; ++axis)
+	{
+		volatile stepper_data* s = &steppers[axis];
+		int32_t steps_to_dest= s->target - s->position;
+		if(steps_to_dest > stop)
+			s->target= s->position + stop;
+		else if(steps_to_dest < -stop)
+			s->target= s->position - stop;
+		else
+			continue; // already closer than that
+		s->ramp_length= stop + 1;
+	}
+	steppers_limit_decelerating= true;
+}
+
+// True when the axis must not move because of the limits. Called from the stepper interrupt before
+// each pulse: pending trigger edges are handled here rather than after the interrupt returns.
+static inline bool stepper_limited(uint8_t axis)
+{
+	if(!steppers_respect_endstop || steppers_limit_decelerating)
+		return false;
+	uint8_t mask= steppers_independent_limits ? (1<<axis) : 0xFF;
+	if(!(limits_poll() & mask))
+		return false;
+	if(steppers_limit_decel_steps)
+	{
+		steppers_decelerate(); // controlled stop past the switch (e.g. fast homing)
+		return false;
+	}
+	limits_record_stop();
+	return true;
+}
+
+// The override setters are called from the serial RX interrupt, or with the interrupts enabled
+static void steppers_update_feed_scale()
+{
+	uint16_t target= steppers_held ? 0 : (uint16_t)steppers_override * FEED_SCALE_ONE / 100;
+	uint8_t sreg= SREG;
+	cli();
+	steppers_feed_scale_target= target;
+	SREG= sreg;
+}
+
+void steppers_feed_hold(bool hold)
+{
+	steppers_held= hold;
+	steppers_update_feed_scale();
+}
+
+bool steppers_is_held()
+{
+	return steppers_held;
+}
+
+void steppers_override_change(int8_t percent)
+{
+	int16_t o= steppers_override + percent;
+	if(o<STEPPER_OVERRIDE_MIN) o= STEPPER_OVERRIDE_MIN;
+	if(o>STEPPER_OVERRIDE_MAX) o= STEPPER_OVERRIDE_MAX;
+	steppers_override= o;
+	steppers_update_feed_scale();
+}
+
+void steppers_override_reset()
+{
+	steppers_override= 100;
+	steppers_held= false;
+	steppers_update_feed_scale();
+}
+
+uint8_t steppers_get_override()
+{
+	return steppers_override;
+}
+
 // Stepper acceleration theory and profile:  http://www.ti.com/lit/an/slyt482/slyt482.pdf
 // TODO: https://en.wikipedia.org/wiki/Smoothstep ? precomputed bicubic speed variation?
 
@@ -243,6 +370,17 @@ bool steppers_are_moving()
 ISR(TIMER1_COMPA_vect)
 {
 	if(nmi_reset) return;
+	bool stop_axes_moving= false; // axes measured by a pending limit stop
+
+	// Slew the speed override / feed hold
+	uint16_t scale= steppers_feed_scale;
+	if(scale!=steppers_feed_scale_target && ++steppers_slew_ticks>=STEPPER_OVERRIDE_SLEW_TICKS)
+	{
+		steppers_slew_ticks= 0;
+		scale= scale<steppers_feed_scale_target ? scale+1 : scale-1;
+		steppers_feed_scale= scale;
+	}
+
 	for(uint8_t stepper_index=0;stepper_index<3;++stepper_index)
 	{
 		volatile stepper_data* s = &steppers[stepper_index];
@@ -254,14 +392,11 @@ ISR(TIMER1_COMPA_vect)
 		// How far are we from the target (absolute value)?
 		int32_t steps_to_dest= target - position;
 		if(steps_to_dest==0) continue; // already there
+		if(limit_stop_axes & (1<<stepper_index))
+			stop_axes_moving= true;
 
-		#ifdef MOVE_SHARE_LIMITS
-			if(steppers_respect_endstop && sticky_limits)
-				return;
-		#else
-			if(steppers_respect_endstop && sticky_limit_is_hit(stepper_index))
-				return;
-		#endif
+		if(stepper_limited(stepper_index))
+			continue;
 
 		uint8_t positive= (steps_to_dest>0) ? 1 : 0;
 		if(!positive) steps_to_dest= -steps_to_dest; // the stepper direction was already set during stepper_set_target()
@@ -282,6 +417,19 @@ ISR(TIMER1_COMPA_vect)
 			else // No, we are far from both bounds, so run full speed (that is, when ends are far enough)
 				speed= stepper_speed * s->ramp_length / STEPPER_STEPS_TO_FULL_SPEED; // may be less than full speed if ramp is too short
 		}
+		if(scale!=FEED_SCALE_ONE)
+		{
+			int32_t scaled= (speed * scale) >> 8;
+			if(scaled>STEPPER_MAX_SPEED && scaled>speed) // an override never goes past full speed (one pulse per interrupt)
+				scaled= speed>STEPPER_MAX_SPEED ? speed : STEPPER_MAX_SPEED;
+			speed= scaled;
+			if(speed<STEPPER_MIN_SPEED)
+			{
+				if(steppers_held)
+					continue; // slow enough to stop abruptly: paused until resumed
+				speed= STEPPER_MIN_SPEED;
+			}
+		}
 
 		// Accumulate and do the movement
 		uint16_t accu= s->fp_accu;
@@ -290,6 +438,10 @@ ISR(TIMER1_COMPA_vect)
 		// sequentially, or use a faster interrupt again...
 		while(accu >= FIXED_POINT_OVF) // in the best world and for more regular timings, there would be no "while", just one "if"
 		{
+			if(stepper_limited(stepper_index))
+				break;
+			if(limit_stop_pending && (limit_stop_axes & (1<<stepper_index))) // measure the overshoot
+				++limit_stop_steps;
 			if(positive)
 				++position;
 			else
@@ -303,6 +455,10 @@ ISR(TIMER1_COMPA_vect)
 		s->fp_accu= accu;
 		s->position= position;
 	}
+
+	// The motion ended without a hard stop (target reached, deceleration, settle): nothing to measure
+	if(!stop_axes_moving && limit_stop_pending)
+		limit_stop_pending= false;
 }
 
 //
@@ -323,6 +479,97 @@ uint8_t move_modal_axis(uint8_t axis, float pos, float speed_factor)
 	return !nmi_reset && sticky_limits == 0;
 }
 
+// ================= motion queue =================
+// Moves queued by the asynchronous commands, started one after the other from the main loop
+
+typedef struct motion
+{
+	float mm;
+	float speed_factor;
+	uint8_t axis;		// MOTION_ALL_AXES for the whole bed
+	uint8_t seq;		// sequence id of the command which queued it, reported with its end
+} motion;
+
+static Ring<motion, MOTION_QUEUE_SIZE> motion_queue;
+static bool motion_active= false;	// a queued move is running
+static uint8_t motion_active_seq;
+
+void motion_queue_reset()
+{
+	motion_queue.drop_all();
+	motion_active= false;
+}
+
+bool motion_queue_push(uint8_t axis, float mm, float speed_factor, uint8_t seq)
+{
+	motion m;
+	m.mm= mm;
+	m.speed_factor= speed_factor;
+	m.axis= axis;
+	m.seq= seq;
+	return motion_queue.push(m);
+}
+
+// Queued moves, including the running one
+uint8_t motion_queue_count()
+{
+	return motion_queue.count() + (motion_active ? 1 : 0);
+}
+
+// Drops the moves not started yet, returns how many were dropped
+uint8_t motion_queue_flush()
+{
+	uint8_t n= motion_queue.count();
+	motion_queue.drop_all();
+	return n;
+}
+
+// Drops the queued moves and stops the running one, returns false when there was nothing to cancel
+bool motion_queue_cancel()
+{
+	if(!motion_queue_count())
+		return false;
+	steppers_settle_here();
+	motion_queue_reset();
+	return true;
+}
+
+/**
+ * Called from the main loop: reports the end of the running move and starts the next one.
+ * seq receives the sequence id of the move which ended, flushed the number of moves dropped with it.
+ * A move stopped by the limits flushes the queue, the host has to decide what to do next.
+ */
+uint8_t motion_poll(uint8_t* seq, uint8_t* flushed)
+{
+	uint8_t event= MOTION_IDLE;
+	*flushed= 0;
+	if(motion_active)
+	{
+		if(steppers_are_moving())
+			return MOTION_IDLE;
+		motion_active= false;
+		*seq= motion_active_seq;
+		if(sticky_limits)
+		{
+			*flushed= motion_queue_flush();
+			steppers_zero_speed(); // restart at slow speed if resumed
+			return MOTION_LIMIT;
+		}
+		event= MOTION_DONE;
+	}
+	motion m;
+	if(motion_queue.pop(m))
+	{
+		if(m.axis<3)
+			stepper_set_target(m.axis, m.mm, m.speed_factor);
+		else
+			stepper_set_targets(m.mm, m.speed_factor);
+		motion_active= true;
+		motion_active_seq= m.seq;
+	}
+	return event;
+}
+
 void set_origin()
 {
 	uint8_t sreg= SREG;
@@ -22,6 +22,8 @@ typedef struct stepper_data
 extern volatile int32_t stepper_speed;
 extern volatile stepper_data steppers[3];
 extern volatile bool steppers_respect_endstop;
+extern volatile bool steppers_limit_decelerating;
+extern volatile bool steppers_independent_limits;
 
 #define DIRECTION_ALL_ON()       DIRECTION_PORT |=  DIRECTION_MASK
 #define DIRECTION_ALL_OFF()      DIRECTION_PORT &= ~DIRECTION_MASK
@@ -48,10 +50,22 @@ bool stepper_are_powered();
 void stepper_set_targets(float mm, float speed_factor);
 void steppers_zero_speed();
 
+// Feed hold and speed override (real-time characters): the stepper interrupt slews to the new speed
+#define STEPPER_OVERRIDE_MIN	10		// percent
+#define STEPPER_OVERRIDE_MAX	150		// capped at the stepper full speed: speeds up the slower moves only
+#define STEPPER_OVERRIDE_STEP	10
+void steppers_feed_hold(bool hold);
+bool steppers_is_held();
+void steppers_override_change(int8_t percent);
+void steppers_override_reset();
+uint8_t steppers_get_override();
+
 bool stepper_set_target(uint8_t axis, float mm, float speed_factor);
+void steppers_set_limit_deceleration(float mm);
 bool stepper_is_moving(uint8_t axis);
 bool steppers_are_moving();
 
+float stepper_steps_to_mm(int32_t steps);
 float stepper_get_position(uint8_t axis);
 void stepper_override_position(uint8_t axis, float mm);
 int stepper_get_direction(uint8_t axis);
@@ -61,6 +75,21 @@ int stepper_get_direction(uint8_t axis);
 uint8_t move_modal(float pos, float speed_factor);
 uint8_t move_modal_axis(uint8_t axis, float pos, float speed_factor);
 
+#define MOTION_QUEUE_SIZE	8	// asynchronous moves (power of two)
+#define MOTION_ALL_AXES		0xFF
+
+// motion_poll() events
+#define MOTION_IDLE			0
+#define MOTION_DONE			1	// the running move reached its target
+#define MOTION_LIMIT		2	// the running move was stopped by the limits (queue flushed)
+
+void motion_queue_reset();
+bool motion_queue_push(uint8_t axis, float mm, float speed_factor, uint8_t seq);
+uint8_t motion_queue_count();
+uint8_t motion_queue_flush();
+bool motion_queue_cancel();
+uint8_t motion_poll(uint8_t* seq, uint8_t* flushed);
+
 void set_origin();
 void set_origin_single(uint8_t axis);
 
@@ -0,0 +1,140 @@
+/*
+ * telemetry.cpp
+ *
+ *  Telemetry: the millisecond tick takes a status snapshot at the set rate (or when it changed), and the
+ *  serial TX interrupt sends it as a binary frame, between two lines of the regular output.
+ *  Nothing is ever waited for: a snapshot is only taken once the previous frame is completely sent.
+ */
+
+#include "main.h"
+#include "telemetry.h"
+#include "status.h"
+#include "serial.h"
+#include <util/crc16.h>
+
+#define TELEMETRY_FRAME_SIZE	(2 + TELEMETRY_FRAME_LENGTH + 1) // sync, length, payload, crc
+
+static volatile uint16_t telemetry_period_ms= 0;	// 0: off
+static volatile bool telemetry_on_change= false;
+static volatile bool telemetry_requested= false;	// one frame, whatever the mode
+static uint16_t telemetry_elapsed_ms= 0;
+
+static status_snapshot telemetry_last;				// last snapshot sent (on change mode)
+static uint8_t telemetry_frame[TELEMETRY_FRAME_SIZE-1]; // crc excluded: computed while sending
+static volatile uint8_t telemetry_index= 0;			// next byte to send
+static volatile bool telemetry_ready= false;		// a frame waits for the TX interrupt
+static uint8_t telemetry_crc;
+
+void telemetry_set(uint16_t period_ms, bool on_change)
+{
+	uint8_t sreg= SREG;
+	cli();
+	telemetry_period_ms= period_ms;
+	telemetry_on_change= on_change;
+	telemetry_elapsed_ms= 0;
+	memset(&telemetry_last, 0xFF, sizeof(telemetry_last)); // first snapshot is always sent
+	SREG= sreg;
+}
+
+uint16_t telemetry_get_period()
+{
+	return telemetry_period_ms;
+}
+
+bool telemetry_is_on_change()
+{
+	return telemetry_on_change;
+}
+
+// Sends a frame on the next tick (status snapshot real-time character)
+void telemetry_request()
+{
+	telemetry_requested= true;
+}
+
+// Called every millisecond from the timer interrupt
+void telemetry_tick()
+{
+	bool requested= telemetry_requested;
+	if(!telemetry_period_ms && !telemetry_on_change && !requested)
+		return;
+	if(telemetry_ready || telemetry_is_sending())
+		return; // previous frame still on its way
+	if(!requested && !telemetry_on_change && ++telemetry_elapsed_ms < telemetry_period_ms)
+		return;
+	telemetry_elapsed_ms= 0;
+	if(requested)
+		telemetry_requested= false;
+
+	status_snapshot s;
+	status_take(&s);
+	if(telemetry_on_change && !requested)
+	{
+		if(!memcmp(&s, &telemetry_last, sizeof(s)))
+			return;
+		telemetry_last= s;
+	}
+
+	uint8_t* p= telemetry_frame;
+	*p++= TELEMETRY_FRAME_SYNC;
+	*p++= TELEMETRY_FRAME_LENGTH;
+	*p++= s.flags;
+	*p++= s.sticky;
+	*p++= s.rt;
+	for(uint8_t axis=0; axis<3; ++axis)
+	{
+		uint32_t v= s.positions_um[axis];
+		for(uint8_t i=0; i<4; ++i, v>>=8)
+			*p++= v & 0xFF;
+	}
+
+	// On change mode does not wake up for these: they come along with the next status change
+	serial_stats link;
+	serial_get_stats(&link);
+	const uint16_t counters[3]= { link.rx_dropped, link.rx_overruns, link.rx_frame_errors };
+	for(uint8_t i=0; i<3; ++i)
+	{
+		*p++= counters[i] & 0xFF;
+		*p++= counters[i] >> 8;
+	}
+	*p++= link.rx_high_water;
+	*p++= link.tx_high_water;
+	telemetry_index= 0;
+	telemetry_ready= true;
+	UCSR0B |= (1 << UDRIE0); // wake up the TX interrupt
+}
+
+bool telemetry_is_sending()
+{
+	return telemetry_index!=0;
+}
+
+bool telemetry_is_ready()
+{
+	return telemetry_ready;
+}
+
+// Called from the TX interrupt once telemetry_is_ready() or telemetry_is_sending(), or by the polled TX path (interrupts off) to finish a frame
+uint8_t telemetry_next_byte()
+{
+	uint8_t i= telemetry_index;
+	uint8_t b;
+	if(i==0)
+	{
+		telemetry_ready= false;
+		telemetry_crc= 0;
+		b= telemetry_frame[0]; // sync is not covered by the crc
+	}
+	else if(i<sizeof(telemetry_frame))
+	{
+		b= telemetry_frame[i];
+		telemetry_crc= _crc8_ccitt_update(telemetry_crc, b);
+	}
+	else
+	{
+		telemetry_index= 0; // frame done
+		return telemetry_crc;
+	}
+	telemetry_index= i+1;
+	return b;
+}
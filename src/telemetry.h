@@ -0,0 +1,28 @@
+/*
+ * telemetry.h
+ *
+ *  Periodic or on change status frames, pushed to the master without polling
+ */
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+// Same layout as the binary status frame (see status.h), with its own sync byte, and the serial link
+// health appended to the payload: rx dropped, rx overruns, rx framing errors (uint16, little endian),
+// rx high-water, tx high-water (see serial_stats)
+#define TELEMETRY_FRAME_SYNC	0xA6
+#define TELEMETRY_FRAME_LENGTH	(STATUS_FRAME_LENGTH + 3*2 + 2)	// payload bytes
+
+void telemetry_set(uint16_t period_ms, bool on_change);
+uint16_t telemetry_get_period();
+bool telemetry_is_on_change();
+
+void telemetry_request();
+void telemetry_tick();
+
+// TX interrupt side
+bool telemetry_is_sending();
+bool telemetry_is_ready();
+uint8_t telemetry_next_byte();
+
+#endif /* TELEMETRY_H_ */
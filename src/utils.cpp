@@ -22,6 +22,8 @@
 #include <avr/interrupt.h>
 #include "main.h"
 #include "utils.h"
+#include "limits.h"
+#include "telemetry.h"
 
 volatile bool nmi_reset= 0;
 
@@ -157,25 +159,32 @@ volatile uint64_t millis_prv = 0;
 
 void millis_init()
 {
- TCCR0A = 0;
- // set timer0 with CLKio/8 prescaler
+ // set timer0 in CTC mode with CLKio/64 prescaler (4us per count), compare match every ms
+ TCCR0A = _BV(WGM01);
  TCCR0B = _BV(CS01) | _BV(CS00);
- // clear any TOV1 Flag set when the timer overflowed
- TIFR0 &= ~TOV0;
- // set timer0 counter initial value to 0
+ OCR0A = (uint8_t)((F_CPU/64)/1000 - 1);
+ // set timer0 counter initial value to 0, and clear any pending compare match
  TCNT0 = 0x0;
- // enable timer overflow interrupt for Timer0
- TIMSK0 = _BV(TOIE0);
+ TIFR0 = _BV(OCF0A);
+ // enable compare match interrupt for Timer0
+ TIMSK0 = _BV(OCIE0A);
  // clear the Power Reduction Timer/Counter0
- PRR &= ~PRTIM0;
+ PRR &= ~_BV(PRTIM0);
 }
 
-// TIMER0 interrupt handler
-ISR(TIMER0_OVF_vect)
+// TIMER0 interrupt handler (the counter is cleared automatically on compare match)
+static volatile bool telemetry_in_tick= false;
+ISR(TIMER0_COMPA_vect)
 {
- // reset the counter (overflow is cleared automatically)
- TCNT0 = (uint8_t)(0xFF - ((F_CPU/8)/1000)); // use CLKio/8 prescaler (set CS0n accordingly above)
  millis_prv++;
+ limits_tick(); // endstops debouncing
+ if(telemetry_in_tick)
+  return; // nested in the previous tick (held off by the stepper interrupt): one frame is built at a time
+ telemetry_in_tick= true;
+ sei(); // the telemetry snapshot is not urgent: let the stepper interrupt preempt it
+ telemetry_tick();
+ cli();
+ telemetry_in_tick= false;
 }
 
 // return elapsed time in milliseconds
@@ -184,5 +193,17 @@ uint64_t millis()
  return millis_prv;
 }
 
+// return elapsed time in microseconds (wraps after about 71 minutes)
+uint32_t micros()
+{
+ uint8_t sreg = SREG;
+ cli();
+ uint32_t ms = millis_prv;
+ uint8_t t = TCNT0;
+ if ((TIFR0 & _BV(OCF0A)) && t < OCR0A) ms++; // the counter wrapped but its interrupt is pending
+ SREG = sreg;
+ return ms * 1000 + t * (64 / (F_CPU/1000000));
+}
+
 // Simple hypotenuse computation function.
 float hypot_f(float x, float y) { return(sqrt(x*x + y*y)); }
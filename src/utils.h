@@ -76,6 +76,7 @@ void delay_us(uint32_t us);
 // Main timer initialisation
 void millis_init();
 uint64_t millis();
+uint32_t micros();
 
 // Computes hypotenuse, avoiding avr-gcc's bloated version and the extra error checking.
 float hypot_f(float x, float y);
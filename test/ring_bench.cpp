@@ -0,0 +1,97 @@
+/*
+ * ring_bench.cpp
+ *
+ *  Host micro-benchmark of the SPSC ring buffer (src/ring.h): byte per byte vs. block transfers, and the
+ *  modulo indexed ring it replaced. Only the ratios are meaningful for the AVR: make bench
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "ring.h"
+
+#define BYTES	(64UL*1024*1024)
+
+// The former queues: head/tail indices wrapped with a comparison on each access
+template<uint8_t SIZE>
+struct OldRing
+{
+	uint8_t data[SIZE];
+	volatile uint8_t head, tail;
+	OldRing() : head(0), tail(0) {}
+	bool push(uint8_t v)
+	{
+		uint8_t next= head + 1;
+		if(next==SIZE) next= 0;
+		if(next==tail) return false;
+		data[head]= v;
+		head= next;
+		return true;
+	}
+	bool pop(uint8_t& v)
+	{
+		uint8_t t= tail;
+		if(t==head) return false;
+		v= data[t];
+		if(++t==SIZE) t= 0;
+		tail= t;
+		return true;
+	}
+};
+
+static double seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static volatile uint8_t sink;
+
+static void report(const char* name, double t)
+{
+	printf("%-24s %7.1f MB/s\n", name, BYTES / t / 1e6);
+}
+
+int main()
+{
+	{
+		OldRing<128> r;
+		uint8_t v= 0, x= 0;
+		double t= seconds();
+		for(unsigned long i=0; i<BYTES; i+=32)
+		{
+			for(uint8_t j=0; j<32; ++j) r.push(j);
+			for(uint8_t j=0; j<32; ++j) { r.pop(v); x^= v; }
+		}
+		sink= x;
+		report("modulo ring, bytes", seconds()-t);
+	}
+	{
+		Ring<uint8_t, 128> r;
+		uint8_t v= 0, x= 0;
+		double t= seconds();
+		for(unsigned long i=0; i<BYTES; i+=32)
+		{
+			for(uint8_t j=0; j<32; ++j) r.push(j);
+			for(uint8_t j=0; j<32; ++j) { r.pop(v); x^= v; }
+		}
+		sink= x;
+		report("ring, bytes", seconds()-t);
+	}
+	{
+		Ring<uint8_t, 128> r;
+		uint8_t in[32], out[32], x= 0;
+		for(uint8_t j=0; j<32; ++j) in[j]= j;
+		double t= seconds();
+		for(unsigned long i=0; i<BYTES; i+=32)
+		{
+			r.push_block(in, 32);
+			r.pop_block(out, 32);
+			x^= out[31];
+		}
+		sink= x;
+		report("ring, blocks of 32", seconds()-t);
+	}
+	return 0;
+}
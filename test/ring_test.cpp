@@ -0,0 +1,147 @@
+/*
+ * ring_test.cpp
+ *
+ *  Host unit tests of the SPSC ring buffer (src/ring.h): make test
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include "ring.h"
+
+static int failures= 0;
+
+#define CHECK(cond) do { if(!(cond)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+static void test_empty_full()
+{
+	Ring<uint8_t, 8> r;
+	uint8_t v;
+	CHECK(r.empty() && !r.full());
+	CHECK(r.count()==0 && r.space()==8 && r.size()==8);
+	CHECK(!r.pop(v));
+
+	for(uint8_t i=0; i<8; ++i)
+		CHECK(r.push(i));
+	CHECK(r.full() && !r.empty());
+	CHECK(r.count()==8 && r.space()==0);
+	CHECK(!r.push(99)); // all the slots are usable, no more
+
+	for(uint8_t i=0; i<8; ++i)
+		CHECK(r.pop(v) && v==i);
+	CHECK(r.empty());
+	CHECK(!r.pop(v));
+}
+
+// The 8-bit indices run freely: go around them many times with a fill level changing on each turn
+static void test_wrap_around()
+{
+	Ring<uint8_t, 16> r;
+	uint8_t in= 0, out= 0;
+	for(int turn=0; turn<1000; ++turn)
+	{
+		uint8_t n= turn % 17;
+		for(uint8_t i=0; i<n; ++i)
+			if(r.push(in))
+				++in;
+		CHECK(r.count()==(uint8_t)(in-out));
+		for(uint8_t i=0; i<(turn % 13); ++i)
+		{
+			uint8_t v;
+			if(!r.pop(v))
+				break;
+			CHECK(v==out);
+			++out;
+		}
+	}
+	uint8_t v;
+	while(r.pop(v))
+		CHECK(v==out++);
+	CHECK(out==in);
+}
+
+static void test_peek_at()
+{
+	Ring<uint8_t, 8> r;
+	uint8_t v;
+	for(uint8_t i=0; i<6; ++i) r.push(i);
+	for(uint8_t i=0; i<4; ++i) r.pop(v);
+	for(uint8_t i=6; i<12; ++i) r.push(i); // wraps
+	for(uint8_t i=0; i<8; ++i)
+		CHECK(r.peek(i)==4+i);
+	r.at(7)= 42;
+	CHECK(r.peek(7)==42);
+	CHECK(r.peek()==4);
+}
+
+static void test_spans()
+{
+	Ring<uint8_t, 8> r;
+	uint8_t v;
+	for(uint8_t i=0; i<5; ++i) r.push(i);
+	for(uint8_t i=0; i<5; ++i) r.pop(v);
+
+	// 3 free slots to the buffer end, then 5 from the start
+	uint8_t* w;
+	CHECK(r.write_span(&w)==3);
+	w[0]= 10; w[1]= 11; w[2]= 12;
+	r.commit(3);
+	CHECK(r.write_span(&w)==5);
+	w[0]= 13; w[1]= 14;
+	r.commit(2);
+	CHECK(r.count()==5);
+
+	const uint8_t* p;
+	CHECK(r.read_span(&p)==3 && p[0]==10 && p[2]==12);
+	r.consume(3);
+	uint8_t* q;
+	CHECK(r.read_span(&q)==2 && q[0]==13 && q[1]==14);
+	q[1]= 99; // the consumer owns its slots
+	CHECK(r.peek(1)==99);
+	r.consume(2);
+	CHECK(r.empty());
+	CHECK(r.read_span(&p)==0);
+}
+
+static void test_blocks()
+{
+	Ring<uint8_t, 16> r;
+	uint8_t data[40], back[40];
+	for(uint8_t i=0; i<sizeof(data); ++i)
+		data[i]= i*3;
+
+	CHECK(r.push_block(data, 10)==10);
+	CHECK(r.pop_block(back, 7)==7);
+	CHECK(r.push_block(data+10, 30)==13); // stops when full, across the buffer end
+	CHECK(r.full());
+	CHECK(r.pop_block(back+7, 40)==16);
+	for(uint8_t i=0; i<23; ++i)
+		CHECK(back[i]==data[i]);
+	CHECK(r.pop_block(back, 1)==0);
+}
+
+static void test_drop_all()
+{
+	Ring<uint16_t, 4> r;
+	r.push(1000); r.push(2000); r.push(3000);
+	r.drop_all();
+	CHECK(r.empty() && r.space()==4);
+	uint16_t v;
+	CHECK(r.push(4000) && r.pop(v) && v==4000);
+}
+
+int main()
+{
+	test_empty_full();
+	test_wrap_around();
+	test_peek_at();
+	test_spans();
+	test_blocks();
+	test_drop_all();
+	if(failures)
+	{
+		printf("ring_test: %d failure(s)\n", failures);
+		return 1;
+	}
+	printf("ring_test: ok\n");
+	return 0;
+}